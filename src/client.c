@@ -0,0 +1,149 @@
+/* utcsh-client: runs a script in a session of a `utcsh --server`, handing it
+   this process's stdin, stdout, stderr and environment, and exits with the
+   session's exit code. It is kept to the bare minimum so that it starts as
+   fast as possible; see server.h for the protocol. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "io.h"
+#include "server.h"
+
+#define LOST_SERVER_STATUS 255
+
+extern char **environ;
+
+static void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [-s socket] [script]\n", argv0);
+  exit(LOST_SERVER_STATUS);
+}
+
+/* The request payload: the cwd, the script and then the environment, which
+   the session runs in rather than the server's. Exits if it is too long. */
+static char *build_payload(const char *script, size_t *len)
+{
+  char *cwd = getcwd(NULL, 0);
+
+  if (!cwd)
+  {
+    perror("utcsh-client: getcwd");
+    exit(LOST_SERVER_STATUS);
+  }
+
+  *len = strlen(cwd) + 1 + strlen(script) + 1;
+
+  for (char **var = environ; *var; var++)
+  {
+    *len += strlen(*var) + 1;
+  }
+
+  char *payload = malloc(*len);
+
+  if (!payload || *len > SERVER_MAX_REQUEST)
+  {
+    fprintf(stderr, "utcsh-client: paths and environment too long\n");
+    exit(LOST_SERVER_STATUS);
+  }
+
+  char *end = stpcpy(payload, cwd) + 1;
+  end = stpcpy(end, script) + 1;
+
+  for (char **var = environ; *var; var++)
+  {
+    end = stpcpy(end, *var) + 1;
+  }
+
+  free(cwd);
+  return payload;
+}
+
+static int connect_server(const char *socket_path)
+{
+  struct sockaddr_un sun = { .sun_family = AF_UNIX };
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (strlen(socket_path) >= sizeof sun.sun_path || fd == -1)
+  {
+    fprintf(stderr, "utcsh-client: can't use socket '%s'\n", socket_path);
+    exit(LOST_SERVER_STATUS);
+  }
+
+  strcpy(sun.sun_path, socket_path);
+
+  if (connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1)
+  {
+    fprintf(stderr, "utcsh-client: can't reach server at '%s': %s\n", socket_path, strerror(errno));
+    exit(LOST_SERVER_STATUS);
+  }
+
+  return fd;
+}
+
+/* The fds ride along with the header; the payload follows as plain data */
+static bool send_request(int fd, const char *payload, size_t len)
+{
+  ServerRequest req = { len };
+  int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  char control[CMSG_SPACE(sizeof fds)] = {0};
+  struct iovec iov = { &req, sizeof req };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof control,
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+  return sendmsg(fd, &msg, 0) == sizeof req && write_full(fd, payload, len);
+}
+
+int main(int argc, char *argv[])
+{
+  const char *socket_path = getenv(SERVER_SOCKET_ENV);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "+s:")) != -1)
+  {
+    if (opt != 's') {
+      usage(argv[0]);
+    }
+
+    socket_path = optarg;
+  }
+
+  if (!socket_path || argc - optind > 1) {
+    usage(argv[0]);
+  }
+
+  size_t len;
+  char *payload = build_payload(optind < argc ? argv[optind] : "", &len);
+  int fd = connect_server(socket_path);
+
+  if (!send_request(fd, payload, len))
+  {
+    fprintf(stderr, "utcsh-client: can't send request: %s\n", strerror(errno));
+    return LOST_SERVER_STATUS;
+  }
+
+  uint32_t status;
+
+  if (!read_full(fd, &status, sizeof status))
+  {
+    fprintf(stderr, "utcsh-client: lost connection to server\n");
+    return LOST_SERVER_STATUS;
+  }
+
+  return status;
+}
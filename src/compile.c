@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "compile.h"
+#include "profile.h"
+#include "util.h"
+#include "utcsh.r"
+
+/* A growable byte array. Everything in the image is built up in four of these
+   and glued together at the end, since we don't know the section sizes until
+   the whole script has been parsed. */
+typedef struct Buf {
+  char *data;
+  size_t len;
+  size_t cap;
+} Buf;
+
+static size_t buf_push(Buf *buf, const void *src, size_t n)
+{
+  if (buf->len + n > buf->cap)
+  {
+    let cap = buf->cap ? buf->cap : 4096;
+
+    while (cap < buf->len + n) {
+      cap *= 2;
+    }
+
+    buf->data = realloc(buf->data, cap);
+
+    if (!buf->data) {
+      ppanic("realloc");
+    }
+
+    buf->cap = cap;
+  }
+
+  memcpy(buf->data + buf->len, src, n);
+  buf->len += n;
+  return buf->len - n;
+}
+
+static uint32_t buf_push_str(Buf *strtab, const char *str)
+{
+  return buf_push(strtab, str, strlen(str) + 1);
+}
+
+/* Parses every line of `text` and returns the flattened image, which must be
+   freed by the caller. Empty lines are dropped entirely since they would not
+   have done anything anyways. */
+static void *compile_script(const char *text, size_t len, const unsigned char *hash, size_t *image_size)
+{
+  Buf lines = {0}, cmds = {0}, args = {0}, strtab = {0};
+  let nlines = 0u;
+
+  parse_quietly = true;
+
+  uint32_t lineno = 0;
+
+  for (size_t start = 0; start < len; )
+  {
+    let end = start;
+    lineno++;
+
+    while (end < len && text[end] != '\n') {
+      end++;
+    }
+
+    autofree char *linetxt = strndup(text + start, end - start);
+
+    if (!linetxt) {
+      ppanic("strndup");
+    }
+
+    autofree char *rawtxt = strdup(linetxt);
+    start = end + 1;
+
+    let ncmds = 0;
+    let parsed = parse_commands(linetxt, &ncmds);
+
+    CompiledLine line = { cmds.len / sizeof(CompiledCmd), 0, COMPILED_NONE, lineno };
+
+    if (parsed)
+    {
+      for (let i = 0; i < ncmds; i++)
+      {
+        let cmd = parsed + i;
+        CompiledCmd ccmd = {
+          .nwords = cmd->argc + 1,
+          .first_arg = args.len / sizeof(uint32_t),
+          .output = cmd->outputFile ? buf_push_str(&strtab, cmd->outputFile) : COMPILED_NONE,
+          .next = cmd->next,
+        };
+
+        for (let j = 0; j < cmd->argc + 1; j++)
+        {
+          uint32_t off = buf_push_str(&strtab, cmd->argv[j]);
+          buf_push(&args, &off, sizeof off);
+        }
+
+        for (let out = cmd->extraOutputs; out && *out; out++)
+        {
+          uint32_t off = buf_push_str(&strtab, *out);
+          buf_push(&args, &off, sizeof off);
+          ccmd.nextra++;
+        }
+
+        buf_push(&cmds, &ccmd, sizeof ccmd);
+      }
+
+      line.ncmds = ncmds;
+      destruct(parsed, ncmds);
+    }
+    else if (*rawtxt == '\0')
+    {
+      continue;
+    }
+    else
+    {
+      line.raw = buf_push_str(&strtab, rawtxt);
+    }
+
+    buf_push(&lines, &line, sizeof line);
+    nlines++;
+  }
+
+  parse_quietly = false;
+
+  CompiledHeader header = {
+    .magic = COMPILED_MAGIC,
+    .version = COMPILED_VERSION,
+    .nlines = nlines,
+    .ncmds = cmds.len / sizeof(CompiledCmd),
+    .nargs = args.len / sizeof(uint32_t),
+    .strtab_size = strtab.len,
+  };
+
+  memcpy(header.hash, hash, sizeof header.hash);
+
+  Buf image = {0};
+  buf_push(&image, &header, sizeof header);
+
+  Buf *sections[] = { &lines, &cmds, &args, &strtab };
+
+  for (size_t i = 0; i < sizeof sections / sizeof *sections; i++)
+  {
+    if (sections[i]->len) {
+      buf_push(&image, sections[i]->data, sections[i]->len);
+    }
+    free(sections[i]->data);
+  }
+
+  *image_size = image.len;
+  return image.data;
+}
+
+/* Where the compiled image for a script lives. Must be freed by the caller. */
+static char *compiled_path(const char *script, const unsigned char *hash)
+{
+  char *path = NULL;
+  char hex[SHA256_HEX_LEN + 1];
+  let cache_dir = getenv(COMPILED_CACHE_DIR_ENV);
+
+  sha256_to_hex(hash, hex);
+
+  let ret = (cache_dir && *cache_dir)
+    ? asprintf(&path, "%s/%s%s", cache_dir, hex, COMPILED_SUFFIX)
+    : asprintf(&path, "%s%s", script, COMPILED_SUFFIX);
+
+  if (ret == -1) {
+    ppanic("asprintf");
+  }
+
+  return path;
+}
+
+/* Whether `off` starts a string inside the string table */
+static bool string_is_valid(const CompiledHeader *header, uint32_t off)
+{
+  return off < header->strtab_size;
+}
+
+/* Checks that `size` bytes at `image` look like a complete image built from a
+   script with the given hash, and that every index and offset in it stays
+   within its section, so that a truncated, corrupted or foreign file can
+   never send us reading off the end of the mapping. Anything that fails just
+   gets the script parsed again. */
+static bool image_is_valid(const void *image, size_t size, const unsigned char *hash)
+{
+  const CompiledHeader *header = image;
+
+  if (size < sizeof *header
+      || memcmp(header->magic, COMPILED_MAGIC, sizeof COMPILED_MAGIC) != 0
+      || header->version != COMPILED_VERSION
+      || memcmp(header->hash, hash, sizeof header->hash) != 0) {
+    return false;
+  }
+
+  let expected = sizeof *header
+    + (size_t)header->nlines * sizeof(CompiledLine)
+    + (size_t)header->ncmds * sizeof(CompiledCmd)
+    + (size_t)header->nargs * sizeof(uint32_t)
+    + header->strtab_size;
+
+  if (expected != size) {
+    return false;
+  }
+
+  let lines = (const CompiledLine *)(header + 1);
+  let ccmds = (const CompiledCmd *)(lines + header->nlines);
+  let args = (const uint32_t *)(ccmds + header->ncmds);
+  let strtab = (const char *)(args + header->nargs);
+
+  /* Every string ends inside the table as long as the last one does */
+  if (header->strtab_size && strtab[header->strtab_size - 1] != '\0') {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < header->nlines; i++)
+  {
+    let line = lines + i;
+
+    if (line->raw != COMPILED_NONE
+        ? !string_is_valid(header, line->raw)
+        : (uint64_t)line->first_cmd + line->ncmds > header->ncmds) {
+      return false;
+    }
+  }
+
+  /* run_image lays out argvs assuming the commands' args follow each other
+     exactly as compile_script wrote them */
+  uint64_t next_arg = 0;
+
+  for (uint32_t i = 0; i < header->ncmds; i++)
+  {
+    let ccmd = ccmds + i;
+    let nargs = (uint64_t)ccmd->nwords + ccmd->nextra;
+
+    /* No words is fine: compile_script writes that for a redirect-only line
+       such as `> f`, which eval handles like the parsed form */
+    if (ccmd->first_arg != next_arg
+        || next_arg + nargs > header->nargs
+        || (ccmd->output != COMPILED_NONE && !string_is_valid(header, ccmd->output))) {
+      return false;
+    }
+
+    next_arg += nargs;
+  }
+
+  for (uint32_t i = 0; i < header->nargs; i++)
+  {
+    if (!string_is_valid(header, args[i])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Maps the image at `path` if it exists and matches `hash`. */
+static void *load_image(const char *path, const unsigned char *hash, size_t *size)
+{
+  autoclose int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0) {
+    return NULL;
+  }
+
+  void *image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (image == MAP_FAILED) {
+    return NULL;
+  }
+
+  if (!image_is_valid(image, st.st_size, hash))
+  {
+    munmap(image, st.st_size);
+    return NULL;
+  }
+
+  *size = st.st_size;
+  return image;
+}
+
+/* Best-effort: a read-only script directory just means we recompile next
+   time. Written to a temporary name first so that a concurrent run never maps
+   a half-written image. */
+static void save_image(const char *path, const void *image, size_t size)
+{
+  autofree char *tmp_path = NULL;
+
+  if (asprintf(&tmp_path, "%s.%d.tmp", path, getpid()) == -1) {
+    return;
+  }
+
+  autoclose int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+  if (fd == -1) {
+    return;
+  }
+
+  if (!write_full(fd, image, size) || rename(tmp_path, path) == -1) {
+    unlink(tmp_path);
+  }
+}
+
+/* Turns the image back into Commands and evaluates them line by line. The
+   argv strings point straight into the image, so nothing here is freed; it
+   all lives until the shell exits. */
+static void run_image(const char *image)
+{
+  let header = (const CompiledHeader *)image;
+  let lines = (const CompiledLine *)(header + 1);
+  let ccmds = (const CompiledCmd *)(lines + header->nlines);
+  let args = (const uint32_t *)(ccmds + header->ncmds);
+  let strtab = (const char *)(args + header->nargs);
+
+  Command *commands = calloc(header->ncmds ? header->ncmds : 1, sizeof(Command));
+  /* Room for the NULL after every argv, and after every list of extra outputs */
+  char **argvs = calloc(header->nargs + 2 * header->ncmds + 1, sizeof(char*));
+
+  if (!commands || !argvs) {
+    ppanic("calloc");
+  }
+
+  for (uint32_t i = 0; i < header->ncmds; i++)
+  {
+    let ccmd = ccmds + i;
+    let cmd = commands + i;
+
+    cmd->argc = ccmd->nwords - 1;
+    cmd->argv = argvs;
+    cmd->outputFile = (ccmd->output == COMPILED_NONE) ? NULL : (char *)strtab + ccmd->output;
+    cmd->next = ccmd->next <= CONNECT_SEQ ? ccmd->next : CONNECT_END;
+
+    for (uint32_t j = 0; j < ccmd->nwords; j++)
+    {
+      *argvs++ = (char *)strtab + args[ccmd->first_arg + j];
+    }
+    *argvs++ = NULL;
+
+    if (ccmd->nextra)
+    {
+      cmd->extraOutputs = argvs;
+
+      for (uint32_t j = 0; j < ccmd->nextra; j++)
+      {
+        *argvs++ = (char *)strtab + args[ccmd->first_arg + ccmd->nwords + j];
+      }
+      *argvs++ = NULL;
+    }
+  }
+
+  for (uint32_t i = 0; i < header->nlines; i++)
+  {
+    let line = lines + i;
+
+    profile_line_begin(line->lineno, line->raw != COMPILED_NONE ? strtab + line->raw : NULL);
+
+    if (line->raw != COMPILED_NONE)
+    {
+      autofree char *rawtxt = strdup(strtab + line->raw);
+      let ncmds = 0;
+      let cmds = parse_commands(rawtxt, &ncmds);
+      profile_line_parsed(cmds, ncmds);
+
+      if (cmds)
+      {
+        printcmds(cmds, ncmds);
+        eval(cmds, ncmds);
+        destruct(cmds, ncmds);
+        profile_line_end();
+      }
+      continue;
+    }
+
+    profile_line_parsed(commands + line->first_cmd, line->ncmds);
+    printcmds(commands + line->first_cmd, line->ncmds);
+    eval(commands + line->first_cmd, line->ncmds);
+    profile_line_end();
+  }
+
+  exit(0);
+}
+
+void run_compiled(const char *path)
+{
+  autoclose int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    ppanic("open");
+  }
+
+  const char *text = "";
+
+  if (st.st_size > 0)
+  {
+    text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (text == MAP_FAILED) {
+      ppanic("mmap");
+    }
+  }
+
+  unsigned char hash[SHA256_LEN];
+  Sha256 sha;
+
+  sha256_init(&sha);
+  sha256_update(&sha, text, st.st_size);
+  sha256_final(&sha, hash);
+
+  autofree char *image_path = compiled_path(path, hash);
+
+  size_t image_size = 0;
+  void *image = load_image(image_path, hash, &image_size);
+
+  if (!image)
+  {
+    image = compile_script(text, st.st_size, hash, &image_size);
+    save_image(image_path, image, image_size);
+  }
+
+  run_image(image);
+}
@@ -0,0 +1,76 @@
+#ifndef UTCSH_COMPILE_H
+#define UTCSH_COMPILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "sha256.h"
+#include "utcsh.r"
+
+/**
+ * Compiled scripts are the parsed form of every line of a script file,
+ * flattened into a single image so that later runs can mmap it and hand the
+ * commands straight to eval without going back through getline and
+ * parse_commands.
+ *
+ * The image is written next to the script as `<script>.utcshc`, or to
+ * `$UTCSH_CACHE_DIR/<hash>.utcshc` if that variable is set. It records the
+ * SHA-256 of the script contents it was built from, so editing the script
+ * silently invalidates it, and a shared cache directory can't hand one script
+ * another's image.
+ */
+
+#define COMPILED_MAGIC "UTCSHC"
+#define COMPILED_VERSION 5
+#define COMPILED_SUFFIX ".utcshc"
+#define COMPILED_CACHE_DIR_ENV "UTCSH_CACHE_DIR"
+
+/* Marks an absent string (e.g. a command without a redirect) */
+#define COMPILED_NONE UINT32_MAX
+
+/** Layout of the image. All offsets are relative to the start of the image.
+ *
+ *    CompiledHeader
+ *    CompiledLine[nlines]
+ *    CompiledCmd[ncmds]
+ *    uint32_t args[nargs]   (string table offsets, one per word, then one
+ *                            per extra redirect target)
+ *    char strtab[strtab_size]
+ */
+typedef struct CompiledHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t nlines;
+  unsigned char hash[SHA256_LEN];
+  uint32_t ncmds;
+  uint32_t nargs;
+  uint32_t strtab_size;
+  uint32_t reserved;
+} CompiledHeader;
+
+/* A line either parsed cleanly into `ncmds` commands, or failed to parse and
+   is kept as `raw` text so that running it reproduces the original error.
+   `lineno` is its (1-based) line in the source script. */
+typedef struct CompiledLine {
+  uint32_t first_cmd;
+  uint32_t ncmds;
+  uint32_t raw;
+  uint32_t lineno;
+} CompiledLine;
+
+typedef struct CompiledCmd {
+  uint32_t nwords;
+  uint32_t first_arg;
+  uint32_t output;
+  uint32_t next;        /* Connector to the command after it */
+  uint32_t nextra;      /* Redirect targets after `output`, in args after the words */
+} CompiledCmd;
+
+/**
+ * Runs the script at `path` through its compiled image, building (and trying
+ * to persist) the image first if it is missing or stale. Does not return:
+ * exits the shell once the last line has been evaluated, just as reaching EOF
+ * on a script does.
+ */
+void run_compiled(const char *path);
+
+#endif//UTCSH_COMPILE_H
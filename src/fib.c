@@ -1,17 +1,75 @@
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include "util.h"
 
-const int MAX = 13;
+/*
+ * A process-spawning stress test. Every node of a tree of workers starts its
+ * children, collects a result from each through a pipe, reaps them, and
+ * passes its own result up the same way. The tree is either the recursive
+ * computation of fib(n) (`fib n`, the original exercise), or a regular tree
+ * with `-f` children per node, `-d` levels deep.
+ *
+ * Children are started with fork(), vfork() + exec, posix_spawn() or
+ * pthread_create(), per `-m`. The exec-based modes re-run this program as
+ * each node (the hidden --node option), the same way a shell starts its
+ * commands. The result goes to stdout, and unless -q a report goes to
+ * stderr: how many workers were started, how fast, and the reap latency, from
+ * a worker writing its result just before it exits to its parent's waitpid()
+ * (or pthread_join()) returning.
+ */
 
-static void doFib(int n, int doPrint);
+extern char **environ;
+
+/* Every worker is alive until its whole subtree is done, so this bounds how
+   many exist at once */
+const long MAX_NODES = 20000;
+
+/* Threads need very little stack, and there can be a lot of them */
+#define THREAD_STACK (64 << 10)
+
+enum Mode { FORK, VFORK, SPAWN, THREAD };
+static const char *mode_names[] = { "fork", "vfork", "spawn", "thread" };
+
+typedef struct Node {
+  long arg;                    /* fib: n. tree: levels left below this node */
+} Node;
+
+/* What a worker writes to its parent when it finishes */
+typedef struct Result {
+  uint64_t value;
+  uint64_t end_ns;
+} Result;
+
+/* Reap latencies, shared by every worker in the tree. It lives in a memfd so
+   that exec'd workers can map it too. */
+typedef struct Shared {
+  uint64_t capacity;
+  uint64_t count;
+  uint64_t latency_ns[];
+} Shared;
+
+static struct {
+  enum Mode mode;
+  long fanout;                 /* 0 for fib */
+  int shm_fd;
+  Shared *shared;
+} opts = { .mode = FORK, .shm_fd = -1 };
 
 inline static void unix_error(char *msg)
 {
@@ -19,55 +77,476 @@ inline static void unix_error(char *msg)
   exit(1);
 }
 
-int main(int argc, char **argv)
+static uint64_t clock_ns(void)
 {
-  int arg;
-  int print = 1;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-  if (argc != 2)
+static long num_children(Node node)
+{
+  if (opts.fanout)
   {
-    fprintf(stderr, "Usage: fib <num>\n");
-    exit(-1);
+    return node.arg > 0 ? opts.fanout : 0;
   }
 
-  arg = atoi(argv[1]);
-  if (arg < 0 || arg > MAX)
+  return node.arg > 1 ? 2 : 0;
+}
+
+static Node child_of(Node node, long i)
+{
+  if (opts.fanout)
   {
-    fprintf(stderr, "number must be between 0 and %d\n", MAX);
-    exit(-1);
+    return (Node){ node.arg - 1 };
   }
 
-  doFib(arg, print);
+  return (Node){ node.arg - 1 - i };
+}
 
-  return 0;
+/* How many workers a tree has, or MAX_NODES + 1 if that's too many */
+static long count_nodes(Node node)
+{
+  long total = 1;
+
+  for (long i = 0; i < num_children(node) && total <= MAX_NODES; i++)
+  {
+    total += count_nodes(child_of(node, i));
+  }
+
+  return total;
 }
 
-static int fib(int n)
+static void record_latency(uint64_t ns)
 {
-  if (n <= 1)
+  let i = __atomic_fetch_add(&opts.shared->count, 1, __ATOMIC_RELAXED);
+
+  if (i < opts.shared->capacity)
   {
-    return n;
+    opts.shared->latency_ns[i] = ns;
   }
+}
 
-  int status1, status2;
+static void write_result(int fd, uint64_t value)
+{
+  Result result = { .value = value, .end_ns = clock_ns() };
 
-  if (fork() == CHILD_PROCESS)
+  if (write(fd, &result, sizeof result) != sizeof result)
   {
-    exit(fib(n - 1));
+    unix_error("write");
   }
+}
+
+static uint64_t read_result(int fd, uint64_t *end_ns)
+{
+  Result result;
+  size_t got = 0;
 
-  if (fork() == CHILD_PROCESS)
+  while (got < sizeof result)
   {
-    exit(fib(n - 2));
+    let n = read(fd, (char *)&result + got, sizeof result - got);
+
+    if (n <= 0)
+    {
+      fprintf(stdout, "fib: a worker died without a result\n");
+      exit(1);
+    }
+
+    got += n;
   }
 
-  wait(&status1);
-  wait(&status2);
+  *end_ns = result.end_ns;
+  return result.value;
+}
+
+static uint64_t run_node(Node node);
+
+typedef struct ThreadArg {
+  Node node;
+  int fd;
+} ThreadArg;
 
-  return WEXITSTATUS(status1) + WEXITSTATUS(status2);
+static void *thread_main(void *p)
+{
+  ThreadArg *arg = p;
+  write_result(arg->fd, run_node(arg->node));
+  close(arg->fd);
+  return NULL;
 }
 
-static void doFib(int n, unused int doPrint)
+/* The argv an exec'd worker for `node` is started with */
+static void node_argv(char **argv, char bufs[][32], Node node)
 {
-  printf("%d\n", fib(n));
+  snprintf(bufs[0], 32, "%ld", node.arg);
+  snprintf(bufs[1], 32, "%d", opts.shm_fd);
+  snprintf(bufs[2], 32, "%ld", opts.fanout);
+
+  let i = 0;
+  argv[i++] = "fib";
+  argv[i++] = "-m";
+  argv[i++] = (char *)mode_names[opts.mode];
+  argv[i++] = "--shm";
+  argv[i++] = bufs[1];
+  argv[i++] = "-f";
+  argv[i++] = bufs[2];
+  argv[i++] = "--node";
+  argv[i++] = bufs[0];
+  argv[i] = NULL;
+}
+
+/* Starts a worker for `node` that writes its result to `fd`. Returns its
+   pid, or 0 for a thread, whose handle goes in `*thread`. */
+static pid_t start_child(Node node, int fd, int *read_fds, long nread, pthread_t *thread)
+{
+  char *argv[10];
+  char bufs[3][32];
+  pid_t pid;
+
+  switch (opts.mode)
+  {
+  case FORK:
+    pid = fork();
+    if (pid == CHILD_PROCESS)
+    {
+      for (long i = 0; i < nread; i++)
+      {
+        close(read_fds[i]);
+      }
+      write_result(fd, run_node(node));
+      _exit(0);
+    }
+    break;
+
+  case VFORK:
+    /* Everything the child needs is built beforehand: between vfork() and
+       exec it may only touch its own stack frame and fds */
+    node_argv(argv, bufs, node);
+    pid = vfork();
+    if (pid == CHILD_PROCESS)
+    {
+      dup2(fd, STDOUT_FILENO);
+      execv("/proc/self/exe", argv);
+      _exit(127);
+    }
+    break;
+
+  case SPAWN:
+  {
+    posix_spawn_file_actions_t actions;
+    node_argv(argv, bufs, node);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, STDOUT_FILENO);
+    errno = posix_spawn(&pid, "/proc/self/exe", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (errno)
+    {
+      pid = -1;
+    }
+    break;
+  }
+
+  case THREAD:
+  {
+    pthread_attr_t attr;
+    ThreadArg *arg = malloc(sizeof *arg);
+    if (!arg)
+    {
+      unix_error("malloc");
+    }
+    *arg = (ThreadArg){ node, fd };
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    errno = pthread_create(thread, &attr, thread_main, arg);
+    pthread_attr_destroy(&attr);
+    return errno ? -1 : 0;
+  }
+  }
+
+  return pid;
+}
+
+/* Computes a node's result by starting its children and adding up theirs */
+static uint64_t run_node(Node node)
+{
+  let n = num_children(node);
+
+  if (n == 0)
+  {
+    return opts.fanout ? 1 : node.arg;
+  }
+
+  int read_fds[n];
+  pid_t pids[n];
+  pthread_t threads[n];
+
+  for (long i = 0; i < n; i++)
+  {
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+      unix_error("pipe");
+    }
+
+    pids[i] = start_child(child_of(node, i), fds[1], read_fds, i, &threads[i]);
+
+    if (pids[i] == -1)
+    {
+      unix_error(opts.mode == THREAD ? "pthread_create" : (char *)mode_names[opts.mode]);
+    }
+
+    /* A thread shares our fds, so it closes its own write end */
+    if (opts.mode != THREAD)
+    {
+      close(fds[1]);
+    }
+
+    read_fds[i] = fds[0];
+  }
+
+  uint64_t total = opts.fanout ? 1 : 0;
+  uint64_t end_ns;
+
+  if (opts.mode == THREAD)
+  {
+    /* There's no joining whichever thread finishes first, so in order */
+    for (long i = 0; i < n; i++)
+    {
+      pthread_join(threads[i], NULL);
+      let reaped = clock_ns();
+      total += read_result(read_fds[i], &end_ns);
+      record_latency(reaped - end_ns);
+      close(read_fds[i]);
+    }
+
+    return total;
+  }
+
+  /* Our only children are this node's, so reap whichever finishes first */
+  for (long reaped_count = 0; reaped_count < n; reaped_count++)
+  {
+    int status;
+    let pid = waitpid(-1, &status, 0);
+    let reaped = clock_ns();
+
+    if (pid == -1)
+    {
+      unix_error("waitpid");
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+      fprintf(stdout, "fib: worker %d failed\n", pid);
+      exit(1);
+    }
+
+    for (long i = 0; i < n; i++)
+    {
+      if (pids[i] == pid)
+      {
+        total += read_result(read_fds[i], &end_ns);
+        record_latency(reaped - end_ns);
+        close(read_fds[i]);
+      }
+    }
+  }
+
+  return total;
+}
+
+static void map_shared(uint64_t capacity)
+{
+  size_t size = sizeof(Shared) + capacity * sizeof(uint64_t);
+
+  if (opts.shm_fd == -1)
+  {
+    /* Not close-on-exec: exec'd workers find it by number */
+    opts.shm_fd = memfd_create("fib", 0);
+    if (opts.shm_fd == -1 || ftruncate(opts.shm_fd, size) == -1)
+    {
+      unix_error("memfd_create");
+    }
+  }
+  else
+  {
+    struct stat st;
+    if (fstat(opts.shm_fd, &st) == -1)
+    {
+      unix_error("fstat");
+    }
+    size = st.st_size;
+  }
+
+  opts.shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, opts.shm_fd, 0);
+
+  if (opts.shared == MAP_FAILED)
+  {
+    unix_error("mmap");
+  }
+
+  if (capacity)
+  {
+    opts.shared->capacity = capacity;
+  }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *sorted, uint64_t n, unsigned pct)
+{
+  uint64_t rank = (n * pct + 99) / 100;
+  return sorted[rank ? rank - 1 : 0] / 1000.0;
+}
+
+static void report(uint64_t spawned, uint64_t elapsed_ns)
+{
+  let n = opts.shared->count < opts.shared->capacity ? opts.shared->count : opts.shared->capacity;
+  uint64_t *lat = opts.shared->latency_ns;
+
+  fprintf(stderr, "%s: %lu workers in %.3fs, %.0f/s\n", mode_names[opts.mode],
+          (unsigned long)spawned, elapsed_ns / 1e9,
+          elapsed_ns ? spawned / (elapsed_ns / 1e9) : 0);
+
+  if (n == 0)
+  {
+    return;
+  }
+
+  qsort(lat, n, sizeof *lat, compare_u64);
+  fprintf(stderr, "reap latency: p50 %.1fus p90 %.1fus p99 %.1fus max %.1fus\n",
+          percentile_us(lat, n, 50), percentile_us(lat, n, 90),
+          percentile_us(lat, n, 99), lat[n - 1] / 1000.0);
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: fib [-m fork|vfork|spawn|thread] [-q] <num>\n"
+          "       fib [-m fork|vfork|spawn|thread] [-q] -f <fanout> [-d <depth>]\n");
+  exit(-1);
+}
+
+static long parse_number(const char *s)
+{
+  char *end;
+  long n = strtol(s, &end, 10);
+
+  if (!*s || *end || n < 0)
+  {
+    usage();
+  }
+
+  return n;
+}
+
+int main(int argc, char **argv)
+{
+  static struct option long_opts[] = {
+    { "mode", required_argument, NULL, 'm' },
+    { "fanout", required_argument, NULL, 'f' },
+    { "depth", required_argument, NULL, 'd' },
+    { "quiet", no_argument, NULL, 'q' },
+    { "node", required_argument, NULL, 'N' },
+    { "shm", required_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 },
+  };
+
+  let quiet = false;
+  long depth = -1;
+  long node_arg = -1;
+  int c;
+
+  while ((c = getopt_long(argc, argv, "+m:f:d:q", long_opts, NULL)) != -1)
+  {
+    switch (c)
+    {
+    case 'm':
+      opts.mode = -1;
+      for (int i = 0; i < 4; i++)
+      {
+        if (strcmp(optarg, mode_names[i]) == 0)
+        {
+          opts.mode = i;
+        }
+      }
+      if ((int)opts.mode == -1)
+      {
+        usage();
+      }
+      break;
+    case 'f':
+      opts.fanout = parse_number(optarg);
+      break;
+    case 'd':
+      depth = parse_number(optarg);
+      break;
+    case 'q':
+      quiet = true;
+      break;
+    case 'N':
+      node_arg = parse_number(optarg);
+      break;
+    case 'S':
+      opts.shm_fd = parse_number(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+
+  /* An exec'd worker: compute, hand the result to our parent, and go */
+  if (node_arg != -1)
+  {
+    map_shared(0);
+    write_result(STDOUT_FILENO, run_node((Node){ node_arg }));
+    return 0;
+  }
+
+  Node root;
+
+  if (opts.fanout)
+  {
+    if (optind != argc)
+    {
+      usage();
+    }
+    root.arg = depth == -1 ? 3 : depth;
+  }
+  else
+  {
+    if (optind != argc - 1 || depth != -1)
+    {
+      usage();
+    }
+    root.arg = parse_number(argv[optind]);
+  }
+
+  let nodes = count_nodes(root);
+
+  if (nodes > MAX_NODES)
+  {
+    fprintf(stderr, "that would start more than %ld workers at once\n", MAX_NODES);
+    exit(-1);
+  }
+
+  map_shared(nodes);
+
+  let started = clock_ns();
+  let result = run_node(root);
+  let elapsed = clock_ns() - started;
+
+  printf("%lu\n", (unsigned long)result);
+  fflush(stdout);
+
+  if (!quiet)
+  {
+    report(nodes - 1, elapsed);
+  }
+
+  return 0;
 }
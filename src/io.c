@@ -0,0 +1,50 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "io.h"
+
+bool read_full(int fd, void *buf, size_t len)
+{
+  char *p = buf;
+
+  while (len > 0)
+  {
+    ssize_t n = read(fd, p, len);
+
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return false;
+    }
+
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
+
+bool write_full(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+
+  while (len > 0)
+  {
+    ssize_t n = write(fd, p, len);
+
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      return false;
+    }
+
+    p += n;
+    len -= n;
+  }
+
+  return true;
+}
@@ -0,0 +1,18 @@
+#ifndef UTCSH_IO_H
+#define UTCSH_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Whole-buffer reads and writes, shared by the shell and utcsh-client. Like
+ * server.h, this must not pull in the shell's own headers, so that the client
+ * stays small.
+ */
+
+/** Reads or writes exactly `len` bytes, retrying short transfers and EINTR.
+ * Returns false on error or end of file. */
+bool read_full(int fd, void *buf, size_t len);
+bool write_full(int fd, const void *buf, size_t len);
+
+#endif//UTCSH_IO_H
@@ -0,0 +1,465 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include "loop.h"
+#include "stats.h"
+#include "util.h"
+
+#define MAX_EVENTS 64
+
+/* An epoll_wait that returns sooner than this found its events already
+   waiting, rather than blocked for them */
+#define LOOP_PENDING_NS 20000
+
+/* How much loop_read_line asks for at a time, as stdio would */
+#define INPUT_READ_SIZE 4096
+
+/* What each epoll registration points at */
+typedef struct Watch {
+  int fd;
+  LoopHandler handler;
+  void *data;
+  struct Watch *next;
+} Watch;
+
+static int epfd = -1;
+static int sigfd = -1;
+static sigset_t original_mask;
+static Watch *watches;
+static Child *children;
+static LoopIdle idle_handler;
+
+uint64_t reaped_wall_ns;
+
+/* When the events being handled happened, as near as we can tell: when the
+   loop woke up for them, or if they were already waiting, when it last went
+   back to running the shell (they came in at some point after that) */
+static uint64_t events_ns;
+static uint64_t left_loop_ns;
+
+static void reap(Child *child, int status, const struct rusage *usage)
+{
+  child->done = true;
+  child->status = status;
+  child->ended_ns = now_ns();
+
+  if (usage)
+  {
+    child->cpu_ns = (usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000000ULL
+      + (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) * 1000ULL;
+  }
+
+  reaped_wall_ns += child->ended_ns - child->started_ns;
+
+  if (child->pid != -1)
+  {
+    let exited = events_ns > child->started_ns ? events_ns : child->started_ns;
+
+    stats_add(jobs_running, -1);
+    stats_record(&stats->reap_lag, child->ended_ns - exited);
+  }
+
+  if (child->pidfd != -1)
+  {
+    loop_remove(child->pidfd);
+    close(child->pidfd);
+    child->pidfd = -1;
+  }
+
+  for (Child **link = &children; *link; link = &(*link)->next)
+  {
+    if (*link == child)
+    {
+      *link = child->next;
+      break;
+    }
+  }
+}
+
+static void on_pidfd(void *data, unused uint32_t events)
+{
+  Child *child = data;
+  struct rusage usage;
+  int status;
+
+  if (wait4(child->pid, &status, WNOHANG, &usage) == child->pid) {
+    reap(child, status, &usage);
+  }
+}
+
+/* Only does real work when pidfds are unavailable; otherwise the pidfds have
+   already told us about every exit, and this just drains the signalfd. */
+static void on_signal(unused void *data, unused uint32_t events)
+{
+  struct signalfd_siginfo info;
+
+  while (read(sigfd, &info, sizeof info) == sizeof info)
+    ;
+
+  for (Child *child = children, *next; child; child = next)
+  {
+    struct rusage usage;
+    int status;
+    next = child->next;
+
+    if (child->pidfd == -1 && wait4(child->pid, &status, WNOHANG, &usage) == child->pid) {
+      reap(child, status, &usage);
+    }
+  }
+}
+
+void loop_init(void)
+{
+  if (epfd != -1)
+  {
+    close(epfd);
+    close(sigfd);
+  }
+
+  for (Watch *watch = watches, *next; watch; watch = next)
+  {
+    next = watch->next;
+    free(watch);
+  }
+
+  watches = NULL;
+  children = NULL;
+  idle_handler = NULL;
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+
+  if (epfd == -1) {
+    ppanic("epoll_create1");
+  }
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+
+  static bool mask_saved = false;
+
+  if (sigprocmask(SIG_BLOCK, &mask, mask_saved ? NULL : &original_mask) == -1) {
+    ppanic("sigprocmask");
+  }
+  mask_saved = true;
+
+  sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  if (sigfd == -1) {
+    ppanic("signalfd");
+  }
+
+  loop_add(sigfd, on_signal, NULL);
+}
+
+bool loop_add(int fd, LoopHandler handler, void *data)
+{
+  Watch *watch = malloc(sizeof *watch);
+
+  if (!watch) {
+    ppanic("malloc");
+  }
+
+  *watch = (Watch){ fd, handler, data, watches };
+
+  struct epoll_event ev = { .events = EPOLLIN, .data.ptr = watch };
+
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+  {
+    free(watch);
+    return false;
+  }
+
+  watches = watch;
+  return true;
+}
+
+void loop_remove(int fd)
+{
+  for (Watch **link = &watches; *link; link = &(*link)->next)
+  {
+    if ((*link)->fd == fd)
+    {
+      let watch = *link;
+      epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+      *link = watch->next;
+      free(watch);
+      return;
+    }
+  }
+}
+
+void loop_set_idle(LoopIdle idle)
+{
+  idle_handler = idle;
+}
+
+static int loop_poll(struct epoll_event *events, int timeout)
+{
+  let before = now_ns();
+  let n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+
+  events_ns = now_ns();
+
+  if (events_ns - before < LOOP_PENDING_NS && left_loop_ns) {
+    events_ns = left_loop_ns;
+  }
+
+  return n;
+}
+
+void loop_run_once(void)
+{
+  struct epoll_event events[MAX_EVENTS];
+  let n = loop_poll(events, idle_handler ? 0 : -1);
+
+  /* Nothing is ready yet: get some idle work done, and only block once
+     there is none left */
+  if (n == 0 && idle_handler)
+  {
+    if (idle_handler()) {
+      left_loop_ns = now_ns();
+      return;
+    }
+
+    n = loop_poll(events, -1);
+  }
+
+  if (n == -1)
+  {
+    if (errno == EINTR) {
+      return;
+    }
+    ppanic("epoll_wait");
+  }
+
+  /* A handler may remove a later watch in this same batch (e.g. reaping a
+     child closes its pidfd), so check each one is still registered before
+     calling into it. */
+  for (let i = 0; i < n; i++)
+  {
+    Watch *watch = events[i].data.ptr;
+
+    for (let live = watches; live; live = live->next)
+    {
+      if (live == watch)
+      {
+        watch->handler(watch->data, events[i].events);
+        break;
+      }
+    }
+  }
+
+  left_loop_ns = now_ns();
+}
+
+void loop_run_until(const bool *done)
+{
+  while (!*done) {
+    loop_run_once();
+  }
+}
+
+pid_t loop_fork(void)
+{
+  fflush(stdout);
+  let pid = fork();
+
+  if (pid == CHILD_PROCESS) {
+    loop_init();
+  }
+
+  return pid;
+}
+
+void loop_prepare_exec(void)
+{
+  sigprocmask(SIG_SETMASK, &original_mask, NULL);
+}
+
+void child_watch(Child *child, pid_t pid)
+{
+  *child = (Child){ .pid = pid, .pidfd = -1, .started_ns = now_ns(), .next = children };
+  children = child;
+
+  if (pid == -1)
+  {
+    reap(child, W_EXITCODE(1, 0), NULL);
+    return;
+  }
+
+  stats_add(jobs_running, 1);
+
+  child->pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+  if (child->pidfd != -1 && !loop_add(child->pidfd, on_pidfd, child))
+  {
+    close(child->pidfd);
+    child->pidfd = -1;
+  }
+
+  /* It may have exited before we started listening for SIGCHLD on its
+     behalf, in which case no signal is coming to tell us about it. */
+  if (child->pidfd == -1) {
+    on_signal(NULL, 0);
+  }
+}
+
+int child_wait(Child *child)
+{
+  loop_run_until(&child->done);
+  return child->status;
+}
+
+static void on_timer(void *data, unused uint32_t events)
+{
+  Timer *timer = data;
+  uint64_t expirations;
+
+  if (read(timer->fd, &expirations, sizeof expirations) == sizeof expirations) {
+    timer->fired = true;
+  }
+}
+
+void timer_start(Timer *timer, long ms)
+{
+  if (timer->fd < 0)
+  {
+    timer->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (timer->fd == -1 || !loop_add(timer->fd, on_timer, timer)) {
+      ppanic("timerfd_create");
+    }
+  }
+
+  /* A zero it_value would disarm the timer instead of firing immediately */
+  struct itimerspec spec = {
+    .it_value = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 + 1 },
+  };
+
+  timer->fired = false;
+
+  if (timerfd_settime(timer->fd, 0, &spec, NULL) == -1) {
+    ppanic("timerfd_settime");
+  }
+}
+
+void timer_cancel(Timer *timer)
+{
+  if (timer->fd >= 0)
+  {
+    loop_remove(timer->fd);
+    close(timer->fd);
+  }
+
+  timer->fd = -1;
+}
+
+void loop_sleep(long ms)
+{
+  Timer timer = TIMER_INIT;
+
+  timer_start(&timer, ms);
+  loop_run_until(&timer.fired);
+  timer_cancel(&timer);
+}
+
+static void on_input(void *data, unused uint32_t events)
+{
+  *(bool *)data = true;
+}
+
+/* Bytes read from the input fd but not yet returned as lines, in
+   data[start, end) */
+static struct {
+  char *data;
+  size_t start;
+  size_t end;
+  size_t cap;
+  bool eof;
+} input;
+
+char *loop_read_line(int fd)
+{
+  char *newline;
+
+  while (!(newline = input.start < input.end ? memchr(input.data + input.start, '\n', input.end - input.start) : NULL))
+  {
+    if (input.eof) {
+      break;
+    }
+
+    /* Move what's left to the front, and make room for another read */
+    memmove(input.data, input.data + input.start, input.end - input.start);
+    input.end -= input.start;
+    input.start = 0;
+
+    if (input.cap - input.end < INPUT_READ_SIZE)
+    {
+      input.cap = input.end + INPUT_READ_SIZE;
+      input.data = realloc(input.data, input.cap);
+
+      if (!input.data) {
+        ppanic("realloc");
+      }
+    }
+
+    let n = read(fd, input.data + input.end, INPUT_READ_SIZE);
+
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      input.eof = true;
+    } else {
+      input.end += n;
+    }
+  }
+
+  let len = newline ? (size_t)(newline - input.data) - input.start : input.end - input.start;
+
+  if (!newline && !len) {
+    return NULL;
+  }
+
+  char *line = malloc(len + 1);
+
+  if (!line) {
+    ppanic("malloc");
+  }
+
+  memcpy(line, input.data + input.start, len);
+  line[len] = '\0';
+  input.start += len + (newline != NULL);
+  return line;
+}
+
+void loop_wait_input(int fd)
+{
+  /* Anything already buffered is ready now, and epoll would not know about
+     it */
+  if (input.start < input.end || input.eof) {
+    return;
+  }
+
+  bool ready = false;
+
+  if (!loop_add(fd, on_input, &ready)) {
+    return; /* Regular files are always ready */
+  }
+
+  loop_run_until(&ready);
+  loop_remove(fd);
+}
@@ -0,0 +1,99 @@
+#ifndef UTCSH_LOOP_H
+#define UTCSH_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * The shell's event loop. Everything the shell blocks on (input becoming
+ * readable, children exiting, signals, and later timers) is an fd registered
+ * with a single epoll instance, so the shell never sits in getline, waitpid
+ * or wait while something else needs attention.
+ *
+ * Children are tracked with pidfds. Signals are blocked and delivered through
+ * a signalfd instead; SIGCHLD doubles as the fallback for kernels without
+ * pidfd_open, in which case watched children are polled with WNOHANG.
+ */
+
+typedef void (*LoopHandler)(void *data, uint32_t events);
+
+/** Creates the epoll instance and signalfd. Called once at startup, and again
+ * (via loop_fork) in every forked child that doesn't immediately exec, since
+ * an epoll instance is shared across fork. */
+void loop_init(void);
+
+/** Registers `fd` for input readiness, calling `handler(data, events)` when it
+ * fires. Returns false if the fd can't be polled (e.g. a regular file). */
+bool loop_add(int fd, LoopHandler handler, void *data);
+void loop_remove(int fd);
+
+/** Waits for and dispatches one round of events */
+void loop_run_once(void);
+
+/** Work to do whenever the loop would otherwise block. `idle` is called while
+ * there are no events ready and should do a small piece of work, returning
+ * false once it has nothing left to do. Forked children start without one. */
+typedef bool (*LoopIdle)(void);
+void loop_set_idle(LoopIdle idle);
+
+/** Dispatches events until `*done` becomes true */
+void loop_run_until(const bool *done);
+
+/** fork() for children that keep running shell code. Gives the child its own
+ * epoll instance and an empty child table. */
+pid_t loop_fork(void);
+
+/** Undoes the loop's signal blocking. Call in a child right before exec. */
+void loop_prepare_exec(void);
+
+/** A child process the loop is reaping for us. Once `done` is set, `status`
+ * holds its wait status. */
+typedef struct Child {
+  pid_t pid;
+  int pidfd;
+  bool done;
+  int status;
+  uint64_t started_ns;
+  uint64_t ended_ns;
+  uint64_t cpu_ns;     /* user + system time, its reaped descendants' included */
+  struct Child *next;
+} Child;
+
+/** Starts watching `pid`. `child` must stay alive until it is done. */
+void child_watch(Child *child, pid_t pid);
+
+/** Total wall time, in nanoseconds, of every child this process has reaped */
+extern uint64_t reaped_wall_ns;
+
+/** Runs the loop until `child` has been reaped and returns its wait status */
+int child_wait(Child *child);
+
+/** A one-shot timer driven by the loop. `fired` is set once it expires.
+ * Initialize with TIMER_INIT before the first timer_start. */
+typedef struct Timer {
+  int fd;       /* -1 while no timerfd is open */
+  bool fired;
+} Timer;
+
+#define TIMER_INIT { .fd = -1 }
+
+/** (Re)arms `timer` to fire `ms` milliseconds from now */
+void timer_start(Timer *timer, long ms);
+void timer_cancel(Timer *timer);
+
+/** Sleeps for `ms` milliseconds, dispatching events in the meantime */
+void loop_sleep(long ms);
+
+/** Reads the next line from `fd` without its newline, or returns NULL at EOF.
+ * Must be freed by the caller. Input is buffered here rather than in stdio,
+ * so that loop_wait_input can tell whether a line is already waiting; only
+ * one fd may be read this way. */
+char *loop_read_line(int fd);
+
+/** Blocks until `fd` has input to read (or is at EOF), dispatching other
+ * events while it waits. Returns at once if loop_read_line already has input
+ * from it buffered. */
+void loop_wait_input(int fd);
+
+#endif//UTCSH_LOOP_H
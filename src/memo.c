@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "memo.h"
+#include "sha256.h"
+#include "util.h"
+
+/* Bumped whenever what goes into a key changes, so old entries stop matching */
+#define MEMO_KEY_TAG "utcsh-memo-2"
+
+extern char **environ;
+
+/* Root of the store, or NULL if there is nowhere to put one. Must be freed by
+   the caller. */
+static char *memo_dir(void)
+{
+  char *dir = NULL;
+  let cache_dir = getenv(MEMO_DIR_ENV);
+  let xdg_dir = getenv("XDG_CACHE_HOME");
+  let home = getenv("HOME");
+  let ret = -1;
+
+  if (cache_dir && *cache_dir) {
+    ret = asprintf(&dir, "%s/memo", cache_dir);
+  } else if (xdg_dir && *xdg_dir) {
+    ret = asprintf(&dir, "%s/utcsh/memo", xdg_dir);
+  } else if (home && *home) {
+    ret = asprintf(&dir, "%s/.cache/utcsh/memo", home);
+  }
+
+  return ret == -1 ? NULL : dir;
+}
+
+/* mkdir -p */
+static bool make_dirs(char *path)
+{
+  for (char *p = path + 1; *p; p++)
+  {
+    if (*p == '/')
+    {
+      *p = '\0';
+      mkdir(path, 0755);
+      *p = '/';
+    }
+  }
+
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+/* Keys and objects are named by SHA-256 rather than content_hash, since
+   nothing is compared on restore: a collision would hand back some other
+   command's output */
+typedef char MemoHash[SHA256_HEX_LEN + 1];
+
+static bool hash_fd(int fd, MemoHash hash)
+{
+  struct stat st;
+  Sha256 sha;
+
+  if (fstat(fd, &st) == -1) {
+    return false;
+  }
+
+  sha256_init(&sha);
+
+  if (st.st_size > 0)
+  {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (data == MAP_FAILED) {
+      return false;
+    }
+
+    sha256_update(&sha, data, st.st_size);
+    munmap(data, st.st_size);
+  }
+
+  sha256_hex(&sha, hash);
+  return true;
+}
+
+static void hash_str(Sha256 *sha, const char *str)
+{
+  sha256_update(sha, str, strlen(str) + 1);
+}
+
+/* Works out cmd's key. Fails if the executable can't be found, in which case
+   there is nothing worth caching. */
+static bool memo_key(Command *cmd, char **inputs, char **outputs, MemoHash key)
+{
+  autofree char *exe = is_absolute_path(cmd->argv[0]) ? strdup(cmd->argv[0]) : find_exe(cmd->argv[0]);
+  autofree char *cwd = getcwd(NULL, 0);
+  struct stat st;
+  Sha256 sha;
+
+  if (!exe || !cwd || stat(exe, &st) == -1) {
+    return false;
+  }
+
+  sha256_init(&sha);
+  hash_str(&sha, MEMO_KEY_TAG);
+  hash_str(&sha, cwd);
+
+  hash_str(&sha, "argv");
+  for (let i = 0; i < cmd->argc + 1; i++)
+  {
+    hash_str(&sha, cmd->argv[i]);
+  }
+
+  /* A rebuilt or replaced executable never matches an old entry */
+  uint64_t identity[] = {
+    st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+  };
+
+  hash_str(&sha, exe);
+  sha256_update(&sha, identity, sizeof identity);
+
+  hash_str(&sha, "inputs");
+  for (let input = inputs; *input; input++)
+  {
+    autoclose int fd = open(*input, O_RDONLY | O_CLOEXEC);
+    MemoHash contents;
+
+    hash_str(&sha, *input);
+    hash_str(&sha, fd != -1 && hash_fd(fd, contents) ? contents : "missing");
+  }
+
+  hash_str(&sha, "outputs");
+  for (let output = outputs; *output; output++)
+  {
+    hash_str(&sha, *output);
+  }
+
+  hash_str(&sha, "environ");
+  for (let var = environ; *var; var++)
+  {
+    hash_str(&sha, *var);
+  }
+
+  sha256_hex(&sha, key);
+  return true;
+}
+
+static char *object_path(const char *dir, const char *hash)
+{
+  char *path = NULL;
+
+  if (asprintf(&path, "%s/objects/%s", dir, hash) == -1) {
+    ppanic("asprintf");
+  }
+
+  return path;
+}
+
+/* Copies the file `fd` into the store, returning its hash in `hash` */
+static bool store_object(const char *dir, int fd, MemoHash hash)
+{
+  if (!hash_fd(fd, hash)) {
+    return false;
+  }
+
+  autofree char *path = object_path(dir, hash);
+
+  if (access(path, F_OK) == 0) {
+    return true;
+  }
+
+  autofree char *tmp_path = NULL;
+
+  if (asprintf(&tmp_path, "%s.%d.tmp", path, getpid()) == -1) {
+    return false;
+  }
+
+  autoclose int tmp = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+  if (tmp == -1 || !copy_fd(fd, tmp) || rename(tmp_path, path) == -1)
+  {
+    unlink(tmp_path);
+    return false;
+  }
+
+  return true;
+}
+
+typedef struct MemoFile {
+  MemoHash hash;
+  char *path;     /* NULL for stdout */
+  int object;
+  int target;
+} MemoFile;
+
+/* Reads the entry at `entry` and restores everything it recorded, setting
+   last_status. Returns false, with nothing touched, if there is no usable
+   entry: it is missing or malformed, an object it refers to has left the
+   store, or a target can't be opened. Once output has started, a failure
+   is reported instead, since running the command now would repeat it. */
+static bool memo_restore(const char *dir, const char *entry)
+{
+  FILE *in = fopen(entry, "re");
+
+  if (!in) {
+    return false;
+  }
+
+  MemoFile *files = NULL;
+  size_t nfiles = 0;
+  autofree char *line = NULL;
+  size_t n = 0;
+  let ok = true;
+
+  while (ok && getline(&line, &n, in) != -1)
+  {
+    MemoHash hash;
+    int end = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+    files = realloc(files, (nfiles + 1) * sizeof(MemoFile));
+
+    if (!files) {
+      ppanic("realloc");
+    }
+
+    if (sscanf(line, "stdout %64[0-9a-f]%n", hash, &end) == 1 && line[end] == '\0') {
+      files[nfiles].path = NULL;
+    } else if (sscanf(line, "file %64[0-9a-f] %n", hash, &end) == 1 && line[end] != '\0') {
+      files[nfiles].path = strdup(line + end);
+    } else {
+      ok = false;
+      continue;
+    }
+
+    ok = strlen(hash) == SHA256_HEX_LEN;
+    strcpy(files[nfiles].hash, hash);
+    files[nfiles].object = files[nfiles].target = -1;
+    nfiles++;
+  }
+
+  fclose(in);
+
+  /* Everything is opened before anything is written, so that a miss never
+     leaves output behind. Targets aren't truncated until their turn comes. */
+  for (size_t i = 0; ok && i < nfiles; i++)
+  {
+    autofree char *path = object_path(dir, files[i].hash);
+    let file = files + i;
+
+    file->object = open(path, O_RDONLY | O_CLOEXEC);
+    file->target = file->object == -1 ? -1
+      : file->path ? open(file->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666) : STDOUT_FILENO;
+    ok = file->object != -1 && file->target != -1;
+  }
+
+  let restored = ok;
+
+  if (ok)
+  {
+    fflush(stdout);
+    last_status = 0;
+  }
+
+  for (size_t i = 0; ok && i < nfiles; i++)
+  {
+    let file = files + i;
+
+    if ((file->path && ftruncate(file->target, 0) == -1) || !copy_fd(file->object, file->target))
+    {
+      scold_user("cache: can't restore %s", file->path ? file->path : "stdout");
+      last_status = 1;
+      ok = false;
+    }
+  }
+
+  for (size_t i = 0; i < nfiles; i++)
+  {
+    if (files[i].object != -1) {
+      close(files[i].object);
+    }
+
+    if (files[i].path && files[i].target != -1) {
+      close(files[i].target);
+    }
+
+    free(files[i].path);
+  }
+  free(files);
+
+  return restored;
+}
+
+/* Runs cmd with its stdout captured, passes the output on, and if it
+   succeeded, records it at `entry` */
+static void memo_record(Command *cmd, char *dir, const char *entry, char **outputs)
+{
+  autoclose int out = memfd_create("cache", MFD_CLOEXEC);
+  autoclose int saved = dup(STDOUT_FILENO);
+
+  if (out == -1 || saved == -1) {
+    return exec_single(cmd);
+  }
+
+  fflush(stdout);
+
+  if (dup2(out, STDOUT_FILENO) == -1) {
+    ppanic("dup2");
+  }
+
+  exec_single(cmd);
+  fflush(stdout);
+
+  if (dup2(saved, STDOUT_FILENO) == -1) {
+    ppanic("dup2");
+  }
+
+  copy_fd(out, STDOUT_FILENO);
+
+  if (last_status != 0) {
+    return;
+  }
+
+  autofree char *objects = NULL;
+  autofree char *entries = NULL;
+  autofree char *tmp_path = NULL;
+
+  if (asprintf(&objects, "%s/objects", dir) == -1
+      || asprintf(&entries, "%s/entries", dir) == -1
+      || asprintf(&tmp_path, "%s.%d.tmp", entry, getpid()) == -1
+      || !make_dirs(objects) || !make_dirs(entries)) {
+    return;
+  }
+
+  FILE *manifest = fopen(tmp_path, "we");
+  MemoHash hash;
+
+  if (!manifest) {
+    return;
+  }
+
+  let ok = store_object(dir, out, hash);
+
+  if (ok) {
+    fprintf(manifest, "stdout %s\n", hash);
+  }
+
+  for (let output = outputs; ok && *output; output++)
+  {
+    autoclose int fd = open(*output, O_RDONLY | O_CLOEXEC);
+    ok = fd != -1 && store_object(dir, fd, hash);
+
+    if (ok) {
+      fprintf(manifest, "file %s %s\n", hash, *output);
+    }
+  }
+
+  if (fclose(manifest) != 0 || !ok || rename(tmp_path, entry) == -1) {
+    unlink(tmp_path);
+  }
+}
+
+void memo_exec(Command *cmd, char **inputs, char **outputs)
+{
+  autofree char *dir = memo_dir();
+  autofree char *entry = NULL;
+  MemoHash key;
+
+  if (!dir || !memo_key(cmd, inputs, outputs, key)) {
+    return exec_single(cmd);
+  }
+
+  if (asprintf(&entry, "%s/entries/%s", dir, key) == -1) {
+    ppanic("asprintf");
+  }
+
+  if (memo_restore(dir, entry)) {
+    return;
+  }
+
+  memo_record(cmd, dir, entry, outputs);
+}
@@ -0,0 +1,40 @@
+#ifndef UTCSH_MEMO_H
+#define UTCSH_MEMO_H
+
+#include <stdbool.h>
+#include "utcsh.r"
+
+/**
+ * Memoized commands, for the `cache` prefix builtin. A command's key hashes
+ * its argv, the working directory, the identity (device, inode, size and
+ * mtime) of the executable find_exe resolves it to, the contents of the input
+ * files it declares, and the environment. A successful run records its stdout
+ * and declared output files; a later run with the same key restores those
+ * instead of running the command at all.
+ *
+ * Everything lives in a content-addressed store under
+ * `$UTCSH_CACHE_DIR/memo`, falling back to `$XDG_CACHE_HOME/utcsh/memo` and
+ * then `~/.cache/utcsh/memo`:
+ *
+ *    objects/<hash>   file contents, named by their SHA-256
+ *    entries/<key>    "stdout <hash>" and "file <hash> <path>" lines
+ *
+ * Keys are SHA-256 too, since an entry is restored on the strength of its
+ * name alone.
+ *
+ * Both are written to a temporary name and renamed into place, so concurrent
+ * shells (or `&` jobs) never see half-written entries.
+ */
+
+#define MEMO_DIR_ENV "UTCSH_CACHE_DIR"
+
+/** Runs the external command `cmd` unless a previous successful run with the
+ * same key was recorded, in which case its stdout and output files are
+ * restored instead and last_status is set to 0. `inputs` and `outputs` are
+ * the NULL-terminated lists of files the command reads and writes.
+ *
+ * On a miss the command's stdout is held back until it exits, since it has to
+ * be recorded as well as passed on. */
+void memo_exec(Command *cmd, char **inputs, char **outputs);
+
+#endif//UTCSH_MEMO_H
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "perf.h"
+#include "util.h"
+
+bool perf_mode = false;
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} counter_defs[PERF_NCOUNTERS] = {
+  [PERF_TASK_CLOCK] = { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+  [PERF_CONTEXT_SWITCHES] = { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  [PERF_CPU_MIGRATIONS] = { "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+  [PERF_PAGE_FAULTS] = { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+  [PERF_CYCLES] = { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  [PERF_INSTRUCTIONS] = { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+};
+
+/* Totals across every command, including those run by forked `&` jobs, so
+   they live in a shared mapping and are only ever updated atomically. */
+typedef struct PerfTotals {
+  pid_t owner;
+  uint64_t commands;
+  uint64_t values[PERF_NCOUNTERS];
+  uint64_t counted[PERF_NCOUNTERS];
+} PerfTotals;
+
+static PerfTotals *totals;
+
+void perf_start(void)
+{
+  if (totals) {
+    return;
+  }
+
+  totals = mmap(NULL, sizeof *totals, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (totals == MAP_FAILED) {
+    ppanic("mmap");
+  }
+
+  totals->owner = getpid();
+  atexit(perf_report_totals);
+}
+
+static int open_counter(int which, pid_t pid)
+{
+  struct perf_event_attr attr = {
+    .size = sizeof attr,
+    .type = counter_defs[which].type,
+    .config = counter_defs[which].config,
+    .disabled = 1,
+    .enable_on_exec = 1,
+    .inherit = 1,
+    .exclude_hv = 1,
+  };
+
+  let fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+
+  /* perf_event_paranoid >= 2 only lets us count userspace */
+  if (fd == -1 && (errno == EACCES || errno == EPERM))
+  {
+    attr.exclude_kernel = 1;
+    fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  }
+
+  return fd;
+}
+
+void perf_open(PerfCounters *counters, pid_t pid)
+{
+  perf_start();
+
+  for (let i = 0; i < PERF_NCOUNTERS; i++)
+  {
+    counters->fds[i] = (pid == -1) ? -1 : open_counter(i, pid);
+  }
+}
+
+void perf_report(PerfCounters *counters, char **argv)
+{
+  char line[512];
+  let len = snprintf(line, sizeof line, "perf: %s:", argv[0]);
+  let any = false;
+
+  for (let i = 0; i < PERF_NCOUNTERS; i++)
+  {
+    uint64_t value;
+    let fd = counters->fds[i];
+
+    if (fd == -1) {
+      continue;
+    }
+
+    if (read(fd, &value, sizeof value) == sizeof value)
+    {
+      __atomic_fetch_add(&totals->values[i], value, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&totals->counted[i], 1, __ATOMIC_RELAXED);
+
+      if (len < (int)sizeof line)
+      {
+        len += (i == PERF_TASK_CLOCK)
+          ? snprintf(line + len, sizeof line - len, " %s %.3fms", counter_defs[i].name, value / 1e6)
+          : snprintf(line + len, sizeof line - len, " %s %lu", counter_defs[i].name, (unsigned long)value);
+      }
+      any = true;
+    }
+
+    close(fd);
+  }
+
+  __atomic_fetch_add(&totals->commands, 1, __ATOMIC_RELAXED);
+
+  if (any) {
+    fprintf(stderr, "%s\n", line);
+  } else {
+    fprintf(stderr, "%s counters unavailable\n", line);
+  }
+}
+
+void perf_report_totals(void)
+{
+  if (!totals || totals->owner != getpid() || totals->commands == 0) {
+    return;
+  }
+
+  fprintf(stderr, "perf: total over %lu commands:", (unsigned long)totals->commands);
+
+  for (let i = 0; i < PERF_NCOUNTERS; i++)
+  {
+    if (totals->counted[i] == 0) {
+      continue;
+    }
+
+    if (i == PERF_TASK_CLOCK) {
+      fprintf(stderr, " %s %.3fms", counter_defs[i].name, totals->values[i] / 1e6);
+    } else {
+      fprintf(stderr, " %s %lu", counter_defs[i].name, (unsigned long)totals->values[i]);
+    }
+  }
+
+  fprintf(stderr, "\n");
+}
@@ -0,0 +1,50 @@
+#ifndef UTCSH_PERF_H
+#define UTCSH_PERF_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Per-command performance counters, for `toggleperf` mode. Counters are
+ * attached to a child between fork and exec (see spawn_external), count the
+ * command and everything it forks, and are read once it has been reaped.
+ *
+ * Any counter the kernel refuses (hardware counters inside most VMs, or
+ * anything at all under a strict perf_event_paranoid) is just left out of
+ * the report.
+ */
+
+enum PerfCounter {
+  PERF_TASK_CLOCK,
+  PERF_CONTEXT_SWITCHES,
+  PERF_CPU_MIGRATIONS,
+  PERF_PAGE_FAULTS,
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_NCOUNTERS
+};
+
+typedef struct PerfCounters {
+  int fds[PERF_NCOUNTERS];
+} PerfCounters;
+
+extern bool perf_mode;
+
+/** Sets up the shell-wide totals, owned by the calling process. Must be
+ * called by the shell itself before it forks any jobs, or their commands are
+ * counted in a mapping only the job can see. Does nothing the second time. */
+void perf_start(void);
+
+/** Attaches counters to `pid`, which must not have exec'd yet. They start
+ * counting when it does. */
+void perf_open(PerfCounters *counters, pid_t pid);
+
+/** Reads and closes the counters, prints them for the command `argv` to
+ * stderr, and adds them to the shell-wide totals. */
+void perf_report(PerfCounters *counters, char **argv);
+
+/** Prints the totals for every command counted so far. Only prints anything
+ * in the process that turned perf mode on, so forked jobs stay quiet. */
+void perf_report_totals(void);
+
+#endif//UTCSH_PERF_H
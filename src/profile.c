@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "loop.h"
+#include "profile.h"
+#include "trace.h"
+#include "util.h"
+
+bool profiling = false;
+
+typedef struct LineProfile {
+  unsigned lineno;
+  char *text;
+  uint64_t parse_ns;
+  uint64_t spawn_ns;
+  uint64_t wall_ns;
+  uint64_t child_wall_ns;
+  uint64_t child_cpu_ns;
+} LineProfile;
+
+static struct {
+  char *prefix;
+  char *script;
+  pid_t owner;
+
+  LineProfile *lines;
+  size_t nlines;
+  size_t cap;
+
+  /* State for the line in progress */
+  LineProfile current;
+  bool keep;
+  uint64_t started_ns;
+  uint64_t parsed_ns;
+  uint64_t reaped_at_start;
+  uint64_t cpu_at_start;
+} prof;
+
+static uint64_t children_cpu_ns(void)
+{
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_CHILDREN, &usage) == -1) {
+    return 0;
+  }
+
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL
+    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+/* `--record` takes its lines from here too */
+static bool tracking(void)
+{
+  return profiling || tracing;
+}
+
+void profile_line_begin(unsigned lineno, const char *text)
+{
+  if (!tracking()) {
+    return;
+  }
+
+  trace_line_begin();
+
+  free(prof.current.text);
+  prof.current = (LineProfile){ .lineno = lineno, .text = text ? strdup(text) : NULL };
+  prof.keep = false;
+  prof.reaped_at_start = reaped_wall_ns;
+  prof.cpu_at_start = children_cpu_ns();
+  prof.started_ns = now_ns();
+}
+
+/* Labels a line from its commands, for when we never saw its source text */
+static char *describe_commands(Command *cmds, int ncmds)
+{
+  char *text = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&text, &len);
+
+  if (!out) {
+    return NULL;
+  }
+
+  for (let i = 0; i < ncmds; i++)
+  {
+    for (let j = 0; j < cmds[i].argc + 1; j++)
+    {
+      fprintf(out, "%s%s", j ? " " : "", cmds[i].argv[j]);
+    }
+
+    if (cmds[i].outputFile) {
+      fprintf(out, " > %s", cmds[i].outputFile);
+    }
+
+    for (let extra = cmds[i].extraOutputs; extra && *extra; extra++) {
+      fprintf(out, " > %s", *extra);
+    }
+
+    static const char *connectors[] = {
+      [CONNECT_END] = "", [CONNECT_AND] = " && ", [CONNECT_OR] = " || ",
+      [CONNECT_PAR] = " & ", [CONNECT_SEQ] = " ; ",
+    };
+
+    fprintf(out, "%s", connectors[cmds[i].next]);
+  }
+
+  fclose(out);
+  return text;
+}
+
+void profile_line_parsed(Command *cmds, int ncmds)
+{
+  if (!tracking()) {
+    return;
+  }
+
+  prof.parsed_ns = now_ns();
+  prof.current.parse_ns = prof.parsed_ns - prof.started_ns;
+  prof.keep = cmds != NULL && ncmds > 0;
+
+  if (prof.keep && !prof.current.text) {
+    prof.current.text = describe_commands(cmds, ncmds);
+  }
+}
+
+void profile_add_spawn(uint64_t ns)
+{
+  prof.current.spawn_ns += ns;
+}
+
+/* Hands the finished current line to --record, and keeps it for the report */
+static void line_finish(void)
+{
+  trace_line(prof.current.lineno, prof.current.text, prof.started_ns, prof.current.wall_ns);
+
+  if (!profiling)
+  {
+    prof.keep = false;
+    return;
+  }
+
+  if (prof.nlines == prof.cap)
+  {
+    prof.cap = prof.cap ? prof.cap * 2 : 256;
+    prof.lines = realloc(prof.lines, prof.cap * sizeof(LineProfile));
+
+    if (!prof.lines) {
+      ppanic("realloc");
+    }
+  }
+
+  prof.lines[prof.nlines++] = prof.current;
+  prof.current.text = NULL;
+  prof.keep = false;
+}
+
+void profile_line_end(void)
+{
+  if (!tracking() || !prof.keep) {
+    return;
+  }
+
+  prof.current.wall_ns = now_ns() - prof.started_ns;
+  prof.current.child_wall_ns = reaped_wall_ns - prof.reaped_at_start;
+  prof.current.child_cpu_ns = children_cpu_ns() - prof.cpu_at_start;
+  line_finish();
+}
+
+void profile_line_forked(const ForkedLine *line, Command *cmds, int ncmds)
+{
+  if (!tracking()) {
+    return;
+  }
+
+  profile_line_begin(line->lineno, line->text);
+  profile_line_parsed(cmds, ncmds);
+
+  if (!prof.keep) {
+    return;
+  }
+
+  let child = line->child;
+
+  prof.started_ns = line->started_ns;
+  prof.current.parse_ns = line->parse_ns;
+  prof.current.spawn_ns = line->spawn_ns;
+  prof.current.wall_ns = child->ended_ns - line->started_ns;
+  prof.current.child_wall_ns = child->ended_ns - child->started_ns;
+  prof.current.child_cpu_ns = child->cpu_ns;
+  line_finish();
+}
+
+static int by_cost(const void *a, const void *b)
+{
+  const LineProfile *x = a, *y = b;
+  return (x->wall_ns < y->wall_ns) - (x->wall_ns > y->wall_ns);
+}
+
+/* Frame names in the folded format are separated by ';' and the count by the
+   last ' ', so neither may show up unescaped in a frame */
+static void write_frame(FILE *out, const char *text)
+{
+  for (; text && *text; text++)
+  {
+    fputc(*text == ';' ? ',' : *text, out);
+  }
+}
+
+static void profile_write(void)
+{
+  if (getpid() != prof.owner) {
+    return;
+  }
+
+  qsort(prof.lines, prof.nlines, sizeof(LineProfile), by_cost);
+
+  autofree char *txt_path = NULL;
+  autofree char *folded_path = NULL;
+
+  if (asprintf(&txt_path, "%s.txt", prof.prefix) == -1 || asprintf(&folded_path, "%s.folded", prof.prefix) == -1) {
+    return;
+  }
+
+  FILE *txt = fopen(txt_path, "w");
+  FILE *folded = fopen(folded_path, "w");
+
+  if (!txt || !folded)
+  {
+    perror("profile");
+
+    if (txt) {
+      fclose(txt);
+    }
+
+    if (folded) {
+      fclose(folded);
+    }
+
+    return;
+  }
+
+  uint64_t total = 0;
+
+  for (size_t i = 0; i < prof.nlines; i++)
+  {
+    total += prof.lines[i].wall_ns;
+  }
+
+  let label = prof.script ? prof.script : "stdin";
+
+  fprintf(txt, "# utcsh profile of %s: %zu lines, %.3f ms\n", label, prof.nlines, total / 1e6);
+  fprintf(txt, "# %6s %12s %12s %12s %12s %12s  %s\n",
+          "line", "total_ms", "parse_ms", "spawn_ms", "child_wall_ms", "child_cpu_ms", "command");
+
+  for (size_t i = 0; i < prof.nlines; i++)
+  {
+    let line = prof.lines + i;
+
+    fprintf(txt, "  %6u %12.3f %12.3f %12.3f %12.3f %12.3f  %s\n",
+            line->lineno, line->wall_ns / 1e6, line->parse_ns / 1e6, line->spawn_ns / 1e6,
+            line->child_wall_ns / 1e6, line->child_cpu_ns / 1e6, line->text ? line->text : "");
+
+    /* Each line's wall time, split into parsing, forking, and everything
+       after that (waiting on the children), in microseconds */
+    uint64_t phases[] = {
+      line->parse_ns,
+      line->spawn_ns,
+      line->wall_ns > line->parse_ns + line->spawn_ns ? line->wall_ns - line->parse_ns - line->spawn_ns : 0,
+    };
+    const char *names[] = { "parse", "spawn", "run" };
+
+    for (size_t p = 0; p < sizeof phases / sizeof *phases; p++)
+    {
+      if (phases[p] / 1000 == 0) {
+        continue;
+      }
+
+      write_frame(folded, label);
+      fprintf(folded, ";%u: ", line->lineno);
+      write_frame(folded, line->text);
+      fprintf(folded, ";%s %lu\n", names[p], (unsigned long)(phases[p] / 1000));
+    }
+  }
+
+  fclose(txt);
+  fclose(folded);
+}
+
+void profile_start(const char *prefix, const char *script)
+{
+  prof.prefix = strdup(prefix ? prefix : PROFILE_DEFAULT_PREFIX);
+  prof.script = script ? strdup(script) : NULL;
+  prof.owner = getpid();
+  profiling = true;
+  atexit(profile_write);
+}
@@ -0,0 +1,57 @@
+#ifndef UTCSH_PROFILE_H
+#define UTCSH_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "loop.h"
+#include "utcsh.r"
+
+/**
+ * The `--profile` line profiler. For every input line it records the time
+ * the shell itself spent on it (parsing, plus forking its children), the wall
+ * time of its children summed across `&` members, and their CPU time. At exit
+ * the lines are written out sorted by cost, as a text table to PREFIX.txt and
+ * in the collapsed-stack format flame graph tools take to PREFIX.folded.
+ *
+ * The same per-line hooks feed `--record` (see trace.h), so they are live
+ * whenever either is on.
+ */
+
+#define PROFILE_DEFAULT_PREFIX "utcsh-profile"
+
+extern bool profiling;
+
+/** Turns on profiling, with reports written at exit. `script` is only used to
+ * label the report and may be NULL for interactive sessions. */
+void profile_start(const char *prefix, const char *script);
+
+/** Starts timing input line `lineno`. `text` may be NULL, in which case the
+ * line is labelled with its parsed commands instead. */
+void profile_line_begin(unsigned lineno, const char *text);
+
+/** Marks the end of parsing for the current line. Lines that parsed into no
+ * commands (blank lines, parse errors) are dropped from the report. */
+void profile_line_parsed(Command *cmds, int ncmds);
+
+/** Finishes the current line */
+void profile_line_end(void);
+
+/** A line that ran from start to finish in a child of its own (--readahead),
+ * while the shell went on to other lines */
+typedef struct ForkedLine {
+  unsigned lineno;
+  const char *text;
+  uint64_t started_ns;         /* when the shell started forking it */
+  uint64_t parse_ns;
+  uint64_t spawn_ns;
+  const Child *child;          /* reaped */
+} ForkedLine;
+
+/** Records a ForkedLine, in place of the begin/parsed/end calls. Only use it
+ * in between other lines, since it takes over the current line's state. */
+void profile_line_forked(const ForkedLine *line, Command *cmds, int ncmds);
+
+/** Adds shell-side time spent forking a child to the current line */
+void profile_add_spawn(uint64_t ns);
+
+#endif//UTCSH_PROFILE_H
@@ -0,0 +1,536 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "loop.h"
+#include "remote.h"
+#include "util.h"
+
+#define RELAY_CHUNK 65536
+
+typedef struct Worker {
+  char *addr;
+  int inflight;
+} Worker;
+
+static Worker *workers;
+static size_t nworkers;
+
+static bool send_frame(int fd, uint32_t type, const void *data, size_t len)
+{
+  RemoteFrame frame = { type, len };
+  return write_full(fd, &frame, sizeof frame) && write_full(fd, data, len);
+}
+
+/* Reads a frame, returning its payload (which must be freed by the caller) or
+   NULL if the connection closed or sent something malformed */
+static char *recv_frame(int fd, RemoteFrame *frame)
+{
+  if (!read_full(fd, frame, sizeof *frame) || frame->len > REMOTE_MAX_PAYLOAD) {
+    return NULL;
+  }
+
+  char *payload = malloc(frame->len + 1);
+
+  if (!payload) {
+    ppanic("malloc");
+  }
+
+  if (!read_full(fd, payload, frame->len))
+  {
+    free(payload);
+    return NULL;
+  }
+
+  payload[frame->len] = '\0';
+  return payload;
+}
+
+/* Splits `addr` into its kind and the rest: "unix:/x" and "/x" are unix
+   sockets, "tcp:h:p" and "h:p" are TCP. The host may be left empty, for
+   loopback. */
+static bool parse_addr(const char *addr, bool *is_unix, const char **rest)
+{
+  if (strncmp(addr, "unix:", 5) == 0)
+  {
+    *is_unix = true;
+    *rest = addr + 5;
+  }
+  else if (strncmp(addr, "tcp:", 4) == 0)
+  {
+    *is_unix = false;
+    *rest = addr + 4;
+  }
+  else
+  {
+    *is_unix = strchr(addr, '/') || !strchr(addr, ':');
+    *rest = addr;
+  }
+
+  if (*is_unix) {
+    return **rest && strlen(*rest) < sizeof ((struct sockaddr_un *)0)->sun_path;
+  }
+
+  let colon = strrchr(*rest, ':');
+  return colon && colon[1];
+}
+
+/* A socket connected to, or listening on, `addr`. Returns -1 on failure. */
+static int open_socket(const char *addr, bool listening)
+{
+  bool is_unix;
+  const char *rest;
+
+  if (!parse_addr(addr, &is_unix, &rest)) {
+    return -1;
+  }
+
+  if (is_unix)
+  {
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    strcpy(sun.sun_path, rest);
+
+    let fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd == -1) {
+      return -1;
+    }
+
+    if (listening) {
+      unlink(rest);
+    }
+
+    let ret = listening
+      ? bind(fd, (struct sockaddr *)&sun, sizeof sun) == -1 || listen(fd, SOMAXCONN) == -1
+      : connect(fd, (struct sockaddr *)&sun, sizeof sun) == -1;
+
+    if (ret)
+    {
+      close(fd);
+      return -1;
+    }
+
+    return fd;
+  }
+
+  autofree char *host = strdup(rest);
+  let port = strrchr(host, ':');
+  *port++ = '\0';
+
+  /* No AI_PASSIVE: a worker runs whatever it is sent, so without a host it
+     only listens on loopback, and listening anywhere else has to be asked
+     for by name (0.0.0.0, ::) */
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+  };
+  struct addrinfo *res;
+
+  if (getaddrinfo(*host ? host : NULL, port, &hints, &res) != 0) {
+    return -1;
+  }
+
+  let fd = -1;
+
+  for (let ai = res; ai && fd == -1; ai = ai->ai_next)
+  {
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+
+    if (fd == -1) {
+      continue;
+    }
+
+    int one = 1;
+
+    if (listening) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    }
+
+    let ret = listening
+      ? bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 || listen(fd, SOMAXCONN) == -1
+      : connect(fd, ai->ai_addr, ai->ai_addrlen) == -1;
+
+    if (ret)
+    {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  freeaddrinfo(res);
+  return fd;
+}
+
+/* A RUN payload is two counts followed by NUL-terminated strings: the cwd,
+   the redirect target ("" for none), `npaths` path entries, then `nwords`
+   words of argv */
+static char *serialize_command(Command *cmd, size_t *len)
+{
+  char *buf = NULL;
+  FILE *out = open_memstream(&buf, len);
+  autofree char *cwd = getcwd(NULL, 0);
+  uint32_t npaths = 0;
+  uint32_t nwords = cmd->argc + 1;
+
+  if (!out || !cwd) {
+    ppanic("serialize_command");
+  }
+
+  for (let path = shell_paths; path && *path; path++) {
+    npaths++;
+  }
+
+  fwrite(&npaths, sizeof npaths, 1, out);
+  fwrite(&nwords, sizeof nwords, 1, out);
+  fwrite(cwd, strlen(cwd) + 1, 1, out);
+  fwrite(cmd->outputFile ? cmd->outputFile : "", strlen(cmd->outputFile ? cmd->outputFile : "") + 1, 1, out);
+
+  for (let path = shell_paths; path && *path; path++) {
+    fwrite(*path, strlen(*path) + 1, 1, out);
+  }
+
+  for (uint32_t i = 0; i < nwords; i++) {
+    fwrite(cmd->argv[i], strlen(cmd->argv[i]) + 1, 1, out);
+  }
+
+  fclose(out);
+  return buf;
+}
+
+/* The inverse of serialize_command. Everything it returns points into
+   `payload`; `paths` and `cmd->argv` must be freed by the caller. */
+static bool deserialize_command(char *payload, size_t len, char **cwd, char ***paths, Command *cmd)
+{
+  uint32_t counts[2];
+
+  if (len < sizeof counts || payload[len - 1] != '\0') {
+    return false;
+  }
+
+  memcpy(counts, payload, sizeof counts);
+
+  let nstrings = 2 + (size_t)counts[0] + counts[1];
+
+  /* Every string takes at least its NUL */
+  if (nstrings > len) {
+    return false;
+  }
+
+  char **strings = calloc(nstrings + 2, sizeof(char*));
+  let p = payload + sizeof counts;
+  size_t found = 0;
+
+  if (!strings) {
+    ppanic("calloc");
+  }
+
+  while (p < payload + len && found < nstrings)
+  {
+    strings[found++] = p;
+    p += strlen(p) + 1;
+  }
+
+  if (found != nstrings || counts[1] == 0)
+  {
+    free(strings);
+    return false;
+  }
+
+  /* Paths and argv both need to be NULL-terminated, so they are copied apart */
+  *cwd = strings[0];
+  *paths = calloc(counts[0] + 1, sizeof(char*));
+  cmd->argv = calloc(counts[1] + 1, sizeof(char*));
+
+  if (!*paths || !cmd->argv) {
+    ppanic("calloc");
+  }
+
+  memcpy(*paths, strings + 2, counts[0] * sizeof(char*));
+  memcpy(cmd->argv, strings + 2 + counts[0], counts[1] * sizeof(char*));
+  cmd->argc = counts[1] - 1;
+  cmd->outputFile = *strings[1] ? strings[1] : NULL;
+
+  free(strings);
+  return true;
+}
+
+/* Worker side: forwards one of a command's output pipes to the connection */
+typedef struct Relay {
+  int from;
+  int to;
+  uint32_t type;
+  bool open;
+} Relay;
+
+static void on_relay(void *data, unused uint32_t events)
+{
+  Relay *relay = data;
+  char buf[RELAY_CHUNK];
+  let n = read(relay->from, buf, sizeof buf);
+
+  if (n > 0 && send_frame(relay->to, relay->type, buf, n)) {
+    return;
+  }
+
+  if (n == -1 && errno == EINTR) {
+    return;
+  }
+
+  loop_remove(relay->from);
+  close(relay->from);
+  relay->open = false;
+}
+
+static void serve_connection(int conn)
+{
+  RemoteFrame frame;
+  autofree char *payload = recv_frame(conn, &frame);
+  autofree char **paths = NULL;
+  char *cwd;
+  Command cmd = {0};
+
+  if (!payload || frame.type != REMOTE_RUN || !deserialize_command(payload, frame.len, &cwd, &paths, &cmd)) {
+    return;
+  }
+
+  autofree char **argv = cmd.argv;
+  uint32_t status = 1;
+
+  if (chdir(cwd) == -1)
+  {
+    autofree char *msg = NULL;
+
+    if (asprintf(&msg, "worker: can't change to '%s'\n", cwd) != -1) {
+      send_frame(conn, REMOTE_STDERR, msg, strlen(msg));
+    }
+
+    send_frame(conn, REMOTE_EXIT, &status, sizeof status);
+    return;
+  }
+
+  set_shell_path(paths);
+
+  int out[2], err[2];
+
+  if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+    ppanic("pipe2");
+  }
+
+  let pid = loop_fork();
+
+  if (pid == CHILD_PROCESS)
+  {
+    autoclose int devnull = open("/dev/null", O_RDONLY);
+
+    if (dup2(out[1], STDOUT_FILENO) == -1 || dup2(out[1], original_stdout) == -1
+        || dup2(err[1], STDERR_FILENO) == -1 || (devnull != -1 && dup2(devnull, STDIN_FILENO) == -1)) {
+      ppanic("dup2");
+    }
+
+    exec_single(&cmd);
+    fflush(stdout);
+    _exit(last_status);
+  }
+
+  close(out[1]);
+  close(err[1]);
+
+  Relay relays[] = {
+    { out[0], conn, REMOTE_STDOUT, true },
+    { err[0], conn, REMOTE_STDERR, true },
+  };
+  Child child;
+
+  for (size_t i = 0; i < sizeof relays / sizeof *relays; i++)
+  {
+    loop_add(relays[i].from, on_relay, relays + i);
+  }
+
+  child_watch(&child, pid);
+
+  while (relays[0].open || relays[1].open || !child.done) {
+    loop_run_once();
+  }
+
+  status = WIFSIGNALED(child.status) ? 128 + WTERMSIG(child.status) : WEXITSTATUS(child.status);
+  send_frame(conn, REMOTE_EXIT, &status, sizeof status);
+}
+
+static void on_accept(void *data, unused uint32_t events)
+{
+  let listener = *(int *)data;
+  let conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+  if (conn == -1) {
+    return;
+  }
+
+  let pid = loop_fork();
+
+  if (pid == CHILD_PROCESS)
+  {
+    close(listener);
+    signal(SIGCHLD, SIG_DFL);
+    serve_connection(conn);
+    _exit(0);
+  }
+
+  close(conn);
+}
+
+void remote_serve(const char *addr)
+{
+  static int listener;
+
+  listener = open_socket(addr, true);
+
+  if (listener == -1)
+  {
+    scold_user("worker: can't listen on '%s'", addr);
+    exit(1);
+  }
+
+  /* Connection handlers are never waited for, so let them reap themselves */
+  signal(SIGCHLD, SIG_IGN);
+
+  if (!loop_add(listener, on_accept, &listener)) {
+    ppanic("loop_add");
+  }
+
+  while (true) {
+    loop_run_once();
+  }
+}
+
+bool remote_set_workers(char **addrs)
+{
+  size_t n = 0;
+
+  for (; addrs[n]; n++)
+  {
+    bool is_unix;
+    const char *rest;
+
+    if (!parse_addr(addrs[n], &is_unix, &rest)) {
+      return false;
+    }
+  }
+
+  for (size_t i = 0; i < nworkers; i++)
+  {
+    free(workers[i].addr);
+  }
+  free(workers);
+
+  workers = calloc(n ? n : 1, sizeof(Worker));
+
+  if (!workers) {
+    ppanic("calloc");
+  }
+
+  for (size_t i = 0; i < n; i++)
+  {
+    workers[i].addr = strdup(addrs[i]);
+  }
+
+  nworkers = n;
+  return true;
+}
+
+bool remote_enabled(void)
+{
+  return nworkers > 0;
+}
+
+static void on_remote_output(void *data, unused uint32_t events)
+{
+  RemoteJob *job = data;
+  RemoteFrame frame;
+  autofree char *payload = recv_frame(job->fd, &frame);
+  let finished = !payload;
+
+  if (payload && frame.type == REMOTE_STDOUT) {
+    fflush(stdout);
+    write_full(STDOUT_FILENO, payload, frame.len);
+  } else if (payload && frame.type == REMOTE_STDERR) {
+    write_full(STDERR_FILENO, payload, frame.len);
+  } else if (payload && frame.type == REMOTE_EXIT && frame.len == sizeof(uint32_t)) {
+    memcpy(&job->status, payload, sizeof(uint32_t));
+    finished = true;
+  }
+
+  if (finished)
+  {
+    loop_remove(job->fd);
+    close(job->fd);
+    job->worker->inflight--;
+    job->done = true;
+  }
+}
+
+bool remote_start(RemoteJob *job, Command *cmd)
+{
+  /* A RUN payload has room for one redirect target, so fan-outs stay here */
+  if (cmd->extraOutputs) {
+    return false;
+  }
+
+  size_t len;
+  autofree char *payload = serialize_command(cmd, &len);
+
+  autofree bool *tried = calloc(nworkers, sizeof(bool));
+
+  if (!tried) {
+    ppanic("calloc");
+  }
+
+  *job = (RemoteJob){ .fd = -1, .status = 1 };
+
+  /* Least busy first, moving on to the next least busy if it's unreachable */
+  for (size_t attempt = 0; attempt < nworkers; attempt++)
+  {
+    Worker *worker = NULL;
+
+    for (size_t i = 0; i < nworkers; i++)
+    {
+      if (!tried[i] && (!worker || workers[i].inflight < worker->inflight)) {
+        worker = workers + i;
+      }
+    }
+
+    tried[worker - workers] = true;
+
+    let fd = open_socket(worker->addr, false);
+
+    if (fd != -1 && send_frame(fd, REMOTE_RUN, payload, len) && loop_add(fd, on_remote_output, job))
+    {
+      job->fd = fd;
+      job->worker = worker;
+      worker->inflight++;
+      return true;
+    }
+
+    scold_user("remote: can't reach worker '%s'", worker->addr);
+
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  return false;
+}
+
+int remote_wait(RemoteJob *job)
+{
+  loop_run_until(&job->done);
+  return job->status;
+}
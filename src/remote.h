@@ -0,0 +1,70 @@
+#ifndef UTCSH_REMOTE_H
+#define UTCSH_REMOTE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "utcsh.r"
+
+/**
+ * Running commands on worker shells. `utcsh --worker ADDR` listens on ADDR
+ * and runs each command sent to it, one per connection, through exec_single
+ * in a forked shell, with the sender's cwd and path. Its stdout and stderr
+ * are streamed back as they are written, followed by its exit status.
+ *
+ * A shell that has registered workers with the `remote` builtin sends every
+ * `&` command on a line to whichever worker has the fewest of its commands
+ * in flight, rather than forking it locally. The last command on the line
+ * still runs locally, since it may be a builtin that has to change the
+ * shell itself.
+ *
+ * ADDR is `unix:PATH` or `tcp:HOST:PORT`; a bare PATH or HOST:PORT also
+ * works, and an empty HOST means loopback. Frames are sent in host byte
+ * order, so a coordinator and its workers have to share an architecture.
+ *
+ * There is no authentication: anyone who can connect to a worker can run
+ * any command as its user. Keep workers on unix sockets or loopback, and
+ * only give a HOST such as 0.0.0.0 on a network you trust completely.
+ */
+
+enum RemoteFrameType {
+  REMOTE_RUN = 1,   /* coordinator -> worker: a serialized command */
+  REMOTE_STDOUT,
+  REMOTE_STDERR,
+  REMOTE_EXIT,      /* payload is the exit code as a uint32_t */
+};
+
+typedef struct RemoteFrame {
+  uint32_t type;
+  uint32_t len;
+} RemoteFrame;
+
+/* Largest payload either side will accept */
+#define REMOTE_MAX_PAYLOAD (64 << 20)
+
+/** A command running on a worker. Once `done` is set, `status` holds its
+ * exit code. */
+typedef struct RemoteJob {
+  int fd;
+  bool done;
+  int status;
+  struct Worker *worker;
+} RemoteJob;
+
+/** Serves commands on `addr` until killed. Never returns. */
+void remote_serve(const char *addr);
+
+/** Replaces the registered workers with `addrs`, a NULL-terminated list.
+ * Returns false (registering none) if any of them isn't an address. */
+bool remote_set_workers(char **addrs);
+
+/** Whether any workers are registered */
+bool remote_enabled(void);
+
+/** Sends `cmd` to the least busy worker. Returns false if no worker could
+ * take it, in which case the caller should run it locally. */
+bool remote_start(RemoteJob *job, Command *cmd);
+
+/** Runs the loop until `job` has finished and returns its exit code */
+int remote_wait(RemoteJob *job);
+
+#endif//UTCSH_REMOTE_H
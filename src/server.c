@@ -0,0 +1,306 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "loop.h"
+#include "server.h"
+#include "util.h"
+
+#define SESSION_FDS 3
+
+/* How long a client gets to send its request before its session gives up */
+#define REQUEST_TIMEOUT_S 1
+
+typedef struct Session {
+  int fds[SESSION_FDS];
+  char *payload;
+  size_t len;
+  char *cwd;
+  char *script;
+  char *env;
+} Session;
+
+static int listen_unix(const char *path)
+{
+  struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+  if (!*path || strlen(path) >= sizeof sun.sun_path) {
+    return -1;
+  }
+
+  strcpy(sun.sun_path, path);
+
+  let fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd == -1) {
+    return -1;
+  }
+
+  unlink(path);
+
+  if (bind(fd, (struct sockaddr *)&sun, sizeof sun) == -1 || listen(fd, SOMAXCONN) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* Reads a client's request. On failure, any fds it did send are closed. */
+static bool recv_request(int conn, Session *session)
+{
+  ServerRequest req;
+  char control[CMSG_SPACE(SESSION_FDS * sizeof(int))] = {0};
+  struct iovec iov = { &req, sizeof req };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof control,
+  };
+
+  let n = recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  let nfds = 0;
+
+  for (let c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+  {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+
+    let count = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+    for (let i = 0; i < count; i++)
+    {
+      int fd;
+      memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof fd);
+
+      if (nfds < SESSION_FDS) {
+        session->fds[nfds++] = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+
+  let ok = n == sizeof req && nfds == SESSION_FDS && !(msg.msg_flags & MSG_CTRUNC)
+    && req.len > 0 && req.len <= SERVER_MAX_REQUEST;
+
+  if (ok)
+  {
+    session->payload = malloc(req.len);
+
+    if (!session->payload) {
+      ppanic("malloc");
+    }
+
+    ok = read_full(conn, session->payload, req.len) && session->payload[req.len - 1] == '\0';
+  }
+
+  /* The cwd, then the script, then the environment */
+  let split = ok ? memchr(session->payload, '\0', req.len) : NULL;
+
+  if (!split || split == session->payload + req.len - 1)
+  {
+    for (let i = 0; i < nfds; i++)
+    {
+      close(session->fds[i]);
+    }
+
+    free(session->payload);
+    return false;
+  }
+
+  session->len = req.len;
+  session->cwd = session->payload;
+  session->script = split + 1;
+  session->env = session->script + strlen(session->script) + 1;
+  return true;
+}
+
+/* The script as seen from the server's cwd, for warming the cache */
+static char *script_path(Session *session)
+{
+  char *path = NULL;
+
+  if (is_absolute_path(session->script)) {
+    return strdup(session->script);
+  }
+
+  if (asprintf(&path, "%s/%s", session->cwd, session->script) == -1) {
+    return NULL;
+  }
+
+  return path;
+}
+
+/* In a session's forked shell: takes on the client's fds, environment and
+   cwd */
+static char *enter_session(Session *session)
+{
+  for (let i = 0; i < SESSION_FDS; i++)
+  {
+    if (dup2(session->fds[i], i) == -1) {
+      ppanic("dup2");
+    }
+  }
+
+  if (dup2(session->fds[STDOUT_FILENO], original_stdout) == -1) {
+    ppanic("dup2");
+  }
+
+  for (let i = 0; i < SESSION_FDS; i++)
+  {
+    if (session->fds[i] >= SESSION_FDS) {
+      close(session->fds[i]);
+    }
+  }
+
+  clearenv();
+
+  for (let var = session->env; var < session->payload + session->len; var += strlen(var) + 1)
+  {
+    if (strchr(var, '=')) {
+      putenv(var);
+    }
+  }
+
+  if (chdir(session->cwd) == -1)
+  {
+    scold_user("server: can't change to '%s'", session->cwd);
+    _exit(1);
+  }
+
+  exe_cache_chdir();
+  return *session->script ? session->script : NULL;
+}
+
+/* The supervisor, forked for each connection: reads the request, starts the
+   session's shell and sends back how it exited, since the session itself may
+   exit from anywhere. Only returns in the shell. */
+static char *supervise(int conn, int warmed)
+{
+  struct timeval timeout = { .tv_sec = REQUEST_TIMEOUT_S };
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+  Session session = {0};
+
+  if (!recv_request(conn, &session)) {
+    _exit(1);
+  }
+
+  let shell = loop_fork();
+
+  if (shell == CHILD_PROCESS)
+  {
+    close(conn);
+    close(warmed);
+    return enter_session(&session);
+  }
+
+  for (let i = 0; i < SESSION_FDS; i++)
+  {
+    close(session.fds[i]);
+  }
+
+  /* While the session runs, resolve the commands its script starts with and
+     hand them to the server, so later sessions find them cached */
+  if (*session.script)
+  {
+    autofree char *script = script_path(&session);
+    let before = exe_cache_size();
+
+    if (script)
+    {
+      warm_exe_cache(1, &script);
+      exe_cache_send(warmed, before);
+    }
+  }
+
+  close(warmed);
+
+  Child child;
+  child_watch(&child, shell);
+
+  let status = child_wait(&child);
+  uint32_t code = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+
+  write_full(conn, &code, sizeof code);
+  _exit(0);
+}
+
+static void on_warmed(void *data, unused uint32_t events)
+{
+  exe_cache_receive(*(int *)data);
+}
+
+static void on_connection(void *data, unused uint32_t events)
+{
+  *(bool *)data = true;
+}
+
+char *server_run(const char *path)
+{
+  let listener = listen_unix(path);
+  int warmed[2];
+  bool pending = false;
+
+  if (listener == -1)
+  {
+    scold_user("server: can't listen on '%s'", path);
+    exit(1);
+  }
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, warmed) == -1) {
+    ppanic("socketpair");
+  }
+
+  if (!loop_add(listener, on_connection, &pending) || !loop_add(warmed[0], on_warmed, warmed)) {
+    ppanic("epoll_ctl");
+  }
+
+  /* Sessions are forked from here, so anything resolved now is resolved
+     for all of them */
+  exe_cache_index();
+
+  /* Each session is supervised by a process of its own, so let those reap
+     themselves */
+  signal(SIGCHLD, SIG_IGN);
+
+  /* Nothing a client sends is waited for here: everything per client happens
+     in its supervisor, so a slow one only holds up itself */
+  while (true)
+  {
+    loop_run_until(&pending);
+    pending = false;
+
+    let conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+    if (conn == -1)
+    {
+      if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN) {
+        ppanic("accept4");
+      }
+      continue;
+    }
+
+    if (loop_fork() == CHILD_PROCESS)
+    {
+      close(listener);
+      close(warmed[0]);
+      signal(SIGCHLD, SIG_DFL);
+      return supervise(conn, warmed[1]);
+    }
+
+    close(conn);
+  }
+}
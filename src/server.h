@@ -0,0 +1,41 @@
+#ifndef UTCSH_SERVER_H
+#define UTCSH_SERVER_H
+
+#include <stdint.h>
+
+/**
+ * `utcsh --server PATH` listens on the Unix socket PATH and starts a shell
+ * session for every utcsh-client that connects, so that running a script
+ * costs a fork of an already warm shell instead of a fresh process. The
+ * executable cache is shared too: the server indexes the path up front, and
+ * each session's supervisor resolves the commands its script starts with and
+ * sends them back, so later sessions find them cached.
+ *
+ * The client sends a ServerRequest carrying its stdin, stdout and stderr as
+ * SCM_RIGHTS, followed by `len` bytes holding its cwd, the script path and
+ * then its environment, one variable per string, all NUL-terminated. An
+ * empty script path means the session reads commands from the client's
+ * stdin. The session runs in the client's cwd and environment, not the
+ * server's. Once the session exits, the server replies with its exit code as
+ * a uint32_t.
+ *
+ * This header is shared with the client, so it must not pull in the shell's
+ * own headers.
+ */
+
+/* Where utcsh-client looks for the socket when not given -s */
+#define SERVER_SOCKET_ENV "UTCSH_SERVER"
+
+/* Largest cwd, script path and environment the server will accept */
+#define SERVER_MAX_REQUEST (1 << 20)
+
+typedef struct ServerRequest {
+  uint32_t len;
+} ServerRequest;
+
+/** Serves sessions on the socket at `path`. Only returns in a session's
+ * shell, with the client's fds, environment and cwd in place, giving the script it should
+ * run, or NULL to read commands from stdin. */
+char *server_run(const char *path);
+
+#endif//UTCSH_SERVER_H
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sha256.h"
+#include "util.h"
+
+static const uint32_t round_constants[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+static void compress(Sha256 *sha, const unsigned char *block)
+{
+  uint32_t w[64];
+  uint32_t v[8];
+
+  for (let i = 0; i < 16; i++)
+  {
+    w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+      | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+  }
+
+  for (let i = 16; i < 64; i++)
+  {
+    let s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    let s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  memcpy(v, sha->state, sizeof v);
+
+  for (let i = 0; i < 64; i++)
+  {
+    let s1 = rotr(v[4], 6) ^ rotr(v[4], 11) ^ rotr(v[4], 25);
+    let ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+    let t1 = v[7] + s1 + ch + round_constants[i] + w[i];
+    let s0 = rotr(v[0], 2) ^ rotr(v[0], 13) ^ rotr(v[0], 22);
+    let maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+
+    memmove(v + 1, v, 7 * sizeof v[0]);
+    v[4] += t1;
+    v[0] = t1 + s0 + maj;
+  }
+
+  for (let i = 0; i < 8; i++)
+  {
+    sha->state[i] += v[i];
+  }
+}
+
+void sha256_init(Sha256 *sha)
+{
+  static const uint32_t initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  memcpy(sha->state, initial, sizeof initial);
+  sha->len = 0;
+}
+
+void sha256_update(Sha256 *sha, const void *data, size_t len)
+{
+  const unsigned char *bytes = data;
+  let used = sha->len % sizeof sha->block;
+
+  sha->len += len;
+
+  /* Top up a partly filled block first, then take whole blocks straight from
+     the input */
+  if (used)
+  {
+    let take = sizeof sha->block - used < len ? sizeof sha->block - used : len;
+    memcpy(sha->block + used, bytes, take);
+    bytes += take;
+    len -= take;
+
+    if (used + take < sizeof sha->block) {
+      return;
+    }
+
+    compress(sha, sha->block);
+  }
+
+  for (; len >= sizeof sha->block; bytes += sizeof sha->block, len -= sizeof sha->block) {
+    compress(sha, bytes);
+  }
+
+  memcpy(sha->block, bytes, len);
+}
+
+void sha256_final(Sha256 *sha, unsigned char digest[SHA256_LEN])
+{
+  let bits = sha->len * 8;
+  unsigned char pad[sizeof sha->block + 8] = { 0x80 };
+  let used = sha->len % sizeof sha->block;
+  let npad = (used < 56 ? 56 : 120) - used;
+
+  for (let i = 0; i < 8; i++)
+  {
+    pad[npad + i] = bits >> (56 - i * 8);
+  }
+
+  sha256_update(sha, pad, npad + 8);
+
+  for (let i = 0; i < SHA256_LEN; i++)
+  {
+    digest[i] = sha->state[i / 4] >> (24 - i % 4 * 8);
+  }
+}
+
+void sha256_to_hex(const unsigned char digest[SHA256_LEN], char hex[SHA256_HEX_LEN + 1])
+{
+  for (let i = 0; i < SHA256_LEN; i++)
+  {
+    sprintf(hex + i * 2, "%02x", digest[i]);
+  }
+}
+
+void sha256_hex(Sha256 *sha, char hex[SHA256_HEX_LEN + 1])
+{
+  unsigned char digest[SHA256_LEN];
+
+  sha256_final(sha, digest);
+  sha256_to_hex(digest, hex);
+}
@@ -0,0 +1,37 @@
+#ifndef UTCSH_SHA256_H
+#define UTCSH_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * SHA-256 (FIPS 180-4), for naming things that must not collide, such as
+ * the memo store's keys and objects. content_hash is much faster, but only
+ * fit for hash tables and change detection.
+ */
+
+#define SHA256_LEN 32
+
+/* Hex digits in a digest, not counting a terminating NUL */
+#define SHA256_HEX_LEN (SHA256_LEN * 2)
+
+typedef struct Sha256 {
+  uint32_t state[8];
+  uint64_t len;
+  unsigned char block[64];
+} Sha256;
+
+void sha256_init(Sha256 *sha);
+void sha256_update(Sha256 *sha, const void *data, size_t len);
+
+/** Writes the digest of everything passed to sha256_update to `digest`.
+ * `sha` must be initialised again before further use. */
+void sha256_final(Sha256 *sha, unsigned char digest[SHA256_LEN]);
+
+/** As sha256_final, but as lowercase hex followed by a NUL */
+void sha256_hex(Sha256 *sha, char hex[SHA256_HEX_LEN + 1]);
+
+/** Formats a digest from sha256_final as sha256_hex would */
+void sha256_to_hex(const unsigned char digest[SHA256_LEN], char hex[SHA256_HEX_LEN + 1]);
+
+#endif//UTCSH_SHA256_H
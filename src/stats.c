@@ -0,0 +1,112 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+#include "util.h"
+
+/* Counts into here until stats_init, so that stats is never NULL */
+static ShellStats early_stats;
+
+ShellStats *stats = &early_stats;
+
+void stats_init(const char *path)
+{
+  let fd = -1;
+
+  if (path)
+  {
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1 || ftruncate(fd, sizeof(ShellStats)) == -1)
+    {
+      scold_user("stats: can't create '%s'", path);
+      exit(1);
+    }
+  }
+
+  ShellStats *shared = mmap(NULL, sizeof(ShellStats), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | (fd == -1 ? MAP_ANONYMOUS : 0), fd, 0);
+
+  if (fd != -1) {
+    close(fd);
+  }
+
+  if (shared == MAP_FAILED) {
+    ppanic("mmap");
+  }
+
+  *shared = early_stats;
+  memcpy(shared->magic, STATS_MAGIC, sizeof shared->magic);
+  shared->version = STATS_VERSION;
+  shared->pid = getpid();
+  stats = shared;
+}
+
+void stats_record(StatsHistogram *hist, uint64_t ns)
+{
+  let us = ns / 1000;
+  let bucket = 0;
+
+  while (bucket < STATS_BUCKETS - 1 && us >= (1ULL << bucket)) {
+    bucket++;
+  }
+
+  __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+  let max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+
+  while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* The upper bound, in microseconds, of the bucket holding the `pct`th
+   percentile, or the maximum if that is lower */
+static uint64_t percentile_us(const StatsHistogram *hist, unsigned pct)
+{
+  let target = (hist->count * pct + 99) / 100;
+  let max_us = hist->max_ns / 1000;
+  uint64_t seen = 0;
+  let i = 0;
+
+  for (; i < STATS_BUCKETS - 1; i++)
+  {
+    seen += hist->buckets[i];
+
+    if (seen >= target && seen) {
+      break;
+    }
+  }
+
+  return (1ULL << i) < max_us ? (1ULL << i) : max_us;
+}
+
+static void print_histogram(FILE *out, const char *name, const StatsHistogram *hist)
+{
+  fprintf(out, "%s_us count=%lu mean=%lu p50=%lu p90=%lu p99=%lu max=%lu\n", name,
+          (unsigned long)hist->count,
+          (unsigned long)(hist->count ? hist->sum_ns / hist->count / 1000 : 0),
+          (unsigned long)(hist->count ? percentile_us(hist, 50) : 0),
+          (unsigned long)(hist->count ? percentile_us(hist, 90) : 0),
+          (unsigned long)(hist->count ? percentile_us(hist, 99) : 0),
+          (unsigned long)(hist->max_ns / 1000));
+}
+
+void stats_print(FILE *out, const ShellStats *s)
+{
+  fprintf(out, "pid %u\n", s->pid);
+  fprintf(out, "commands_parsed %lu\n", (unsigned long)s->commands_parsed);
+  fprintf(out, "builtins %lu\n", (unsigned long)s->builtins);
+  fprintf(out, "externals %lu\n", (unsigned long)s->externals);
+  fprintf(out, "exe_cache_hits %lu\n", (unsigned long)s->exe_cache_hits);
+  fprintf(out, "exe_cache_misses %lu\n", (unsigned long)s->exe_cache_misses);
+  fprintf(out, "jobs_running %ld\n", (long)s->jobs_running);
+  print_histogram(out, "spawn", &s->spawn);
+  print_histogram(out, "reap_lag", &s->reap_lag);
+}
@@ -0,0 +1,62 @@
+#ifndef UTCSH_STATS_H
+#define UTCSH_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Shell-wide counters and latency histograms, printed by the `stats` builtin.
+ * They live in a shared mapping, so the shells forked for `&` jobs, -P
+ * scripts and server sessions all count into the same place, and every update
+ * is a single relaxed atomic, so nothing ever waits on a lock.
+ *
+ * With `--stats FILE` the mapping is backed by FILE, which a scraper can
+ * mmap (or just read) at any time without involving the shell at all. Its
+ * layout is ShellStats below, in host byte order; `stats FILE` prints one.
+ */
+
+#define STATS_MAGIC "UTCSHST"
+#define STATS_VERSION 1
+
+/* Bucket i counts values below 2^i microseconds; the last also takes
+   everything larger */
+#define STATS_BUCKETS 32
+
+typedef struct StatsHistogram {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS];
+} StatsHistogram;
+
+typedef struct ShellStats {
+  char magic[8];
+  uint32_t version;
+  uint32_t pid;                /* the shell that created the mapping */
+
+  uint64_t commands_parsed;
+  uint64_t builtins;           /* commands dispatched by exec_single */
+  uint64_t externals;
+  uint64_t exe_cache_hits;     /* find_exe calls answered from the cache */
+  uint64_t exe_cache_misses;   /* ...and ones that had to search */
+  int64_t jobs_running;        /* children started and not yet reaped */
+
+  StatsHistogram spawn;        /* time the shell spends in fork */
+  StatsHistogram reap_lag;     /* from a child's exit to the shell reaping it */
+} ShellStats;
+
+extern ShellStats *stats;
+
+/** Sets up the counters, backed by the file at `path` if it isn't NULL */
+void stats_init(const char *path);
+
+#define stats_add(field, n) __atomic_add_fetch(&stats->field, (n), __ATOMIC_RELAXED)
+
+/** Adds one value to a histogram */
+void stats_record(StatsHistogram *hist, uint64_t ns);
+
+/** Prints a set of counters, one per line as `name value` */
+void stats_print(FILE *out, const ShellStats *s);
+
+#endif//UTCSH_STATS_H
@@ -0,0 +1,164 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "util.h"
+
+#define TRACE_BUF_SIZE (64 << 10)
+
+bool tracing = false;
+
+/* Records are buffered here rather than in a FILE, so that a forked shell
+   that exits normally can't flush a copy of the buffer into the trace */
+static struct {
+  int fd;
+  pid_t owner;
+  uint64_t started_ns;
+  char *buf;
+  size_t len;
+  /* As of the last record written, and of the line in progress */
+  char *cwd;
+  char *path;
+  char *line_cwd;
+  char *line_path;
+} trace = { .fd = -1 };
+
+static void trace_flush(void)
+{
+  if (trace.len && !write_full(trace.fd, trace.buf, trace.len)) {
+    perror("trace");
+  }
+
+  trace.len = 0;
+}
+
+static void trace_append(const void *data, size_t len)
+{
+  if (trace.len + len > TRACE_BUF_SIZE) {
+    trace_flush();
+  }
+
+  if (len > TRACE_BUF_SIZE)
+  {
+    if (!write_full(trace.fd, data, len)) {
+      perror("trace");
+    }
+    return;
+  }
+
+  memcpy(trace.buf + trace.len, data, len);
+  trace.len += len;
+}
+
+static void trace_finish(void)
+{
+  if (getpid() == trace.owner) {
+    trace_flush();
+  }
+}
+
+void trace_start(const char *path)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  trace.buf = malloc(TRACE_BUF_SIZE);
+
+  if (trace.fd == -1)
+  {
+    scold_user("record: can't create '%s'", path);
+    exit(1);
+  }
+
+  if (!trace.buf) {
+    ppanic("malloc");
+  }
+
+  TraceHeader header = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .started_unix_ns = now.tv_sec * 1000000000ULL + now.tv_nsec,
+  };
+
+  trace.owner = getpid();
+  trace.started_ns = now_ns();
+  trace_append(&header, sizeof header);
+  tracing = true;
+  atexit(trace_finish);
+}
+
+/* The path as the `path` builtin would take it, joined with ':' */
+static char *current_path(void)
+{
+  char *joined = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&joined, &len);
+
+  if (!out) {
+    ppanic("open_memstream");
+  }
+
+  for (let dir = shell_paths; dir && *dir; dir++)
+  {
+    fprintf(out, "%s%s", dir == shell_paths ? "" : ":", *dir);
+  }
+
+  fclose(out);
+  return joined;
+}
+
+/* Replaces `*last` with `now` and returns how much of it to write: all of
+   it if it changed, nothing otherwise */
+static uint32_t changed(char **last, char *now)
+{
+  if (*last && now && strcmp(*last, now) == 0)
+  {
+    free(now);
+    return 0;
+  }
+
+  free(*last);
+  *last = now;
+  return now ? strlen(now) : 0;
+}
+
+void trace_line_begin(void)
+{
+  if (!tracing || getpid() != trace.owner) {
+    return;
+  }
+
+  free(trace.line_cwd);
+  free(trace.line_path);
+  trace.line_cwd = getcwd(NULL, 0);
+  trace.line_path = current_path();
+}
+
+void trace_line(unsigned lineno, const char *text, uint64_t started_ns, uint64_t duration_ns)
+{
+  if (!tracing || getpid() != trace.owner) {
+    return;
+  }
+
+  TraceRecord record = {
+    .start_ns = started_ns - trace.started_ns,
+    .duration_ns = duration_ns,
+    .lineno = lineno,
+    .text_len = text ? strlen(text) : 0,
+    .cwd_len = changed(&trace.cwd, trace.line_cwd),
+    .path_len = changed(&trace.path, trace.line_path),
+  };
+
+  trace.line_cwd = trace.line_path = NULL;
+
+  trace_append(&record, sizeof record);
+  trace_append(trace.cwd, record.cwd_len);
+  trace_append(trace.path, record.path_len);
+  trace_append(text, record.text_len);
+}
@@ -0,0 +1,50 @@
+#ifndef UTCSH_TRACE_H
+#define UTCSH_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * `--record FILE` writes every line the shell reads to a binary trace, with
+ * when it started, how long it took, and the cwd and path it ran under, so
+ * that tests/replay.py can play the same mix of commands back later.
+ *
+ * The file is a TraceHeader followed by one TraceRecord per line. Each record
+ * is followed by `cwd_len` bytes of cwd, `path_len` bytes of path (its
+ * directories joined with ':') and `text_len` bytes of the line itself. The
+ * cwd and path are only written when they differ from the previous record's,
+ * and have length 0 otherwise. Everything is in host byte order.
+ */
+
+#define TRACE_MAGIC "UTCSHTR"
+#define TRACE_VERSION 1
+
+typedef struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t started_unix_ns;   /* wall clock time recording started */
+} TraceHeader;
+
+typedef struct TraceRecord {
+  uint64_t start_ns;          /* since recording started */
+  uint64_t duration_ns;
+  uint32_t lineno;
+  uint32_t text_len;
+  uint32_t cwd_len;
+  uint32_t path_len;
+} TraceRecord;
+
+extern bool tracing;
+
+/** Starts recording to `path`. The trace is written out as it fills up and
+ * at exit. */
+void trace_start(const char *path);
+
+/** Notes the cwd and path a line is about to run under */
+void trace_line_begin(void);
+
+/** Records a line that started at `started_ns` (on the now_ns clock) */
+void trace_line(unsigned lineno, const char *text, uint64_t started_ns, uint64_t duration_ns);
+
+#endif//UTCSH_TRACE_H
@@ -1,16 +1,82 @@
+#define _GNU_SOURCE
 #include "util.h"
 #include "utcsh.r"
+#include "compile.h"
+#include "loop.h"
+#include "perf.h"
+#include "profile.h"
+#include "memo.h"
+#include "remote.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
+#include <ctype.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
 #include <unistd.h>
-#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
-char shell_paths[MAX_ENTRIES_IN_SHELLPATH][MAX_CHARS_PER_CMDLINE];
 static char prompt[] = "utcsh> ";
 static char *default_shell_path[2] = { "/bin", NULL };
+static bool use_compiled_scripts = false;
+static bool batch_mode = false;
+static bool keep_order = false;
+static bool spread_jobs = false;
+static long max_jobs = 0;
+static long readahead_window = 0;
+static long parseahead_depth = 0;
+static long parallel_scripts = 0;
+static char *worker_addr = NULL;
+static char *server_socket = NULL;
+static char *stats_file = NULL;
+
+#define READAHEAD_DEFAULT_WINDOW 16
+#define PARSEAHEAD_DEFAULT_DEPTH 16
+
+int last_status = 0;
+
+/* Set by prefix builtins (`timeout`, ...) for the command they wrap */
+typedef struct Modifiers {
+  long timeout_ms;
+  bool pinned;
+  cpu_set_t cpus;
+  bool reniced;
+  int nice;
+  int ioprio;
+} Modifiers;
+
+static Modifiers modifiers;
+
+/* How long a timed out command gets to handle SIGTERM before SIGKILL */
+#define TIMEOUT_KILL_GRACE_MS 2000
+
+/* The most a `cmd > a > b` copier moves per round */
+#define FANOUT_CHUNK (64 << 10)
+#define TIMEOUT_STATUS 124
+
+/* From linux/ioprio.h, which glibc doesn't wrap */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_WHO_PROCESS 1
+
+bool parse_quietly = false;
+
+#define parse_error(fmt, ...) ({ if (!parse_quietly) scold_user(fmt, ##__VA_ARGS__); })
+
+/* For builtins: reports an error and fails the command */
+#define builtin_error(fmt, ...) ({ last_status = 1; scold_user(fmt, ##__VA_ARGS__); })
+
+/* Expands to the last status anywhere in a word */
+#define STATUS_VAR "$?"
 
 CommandFn functions[] = {
   #define X(name) { #name, name##_builtin },
@@ -21,14 +87,55 @@ CommandFn functions[] = {
 
 int main(int argc, char **argv)
 {
-  autoclose int fd = set_input_source(argc, argv);
+  let nopts = parse_options(argc, argv);
+  let nscripts = argc - nopts;
+  let scripts = argv + nopts;
+
+  stats_init(stats_file);
   set_shell_path(default_shell_path);
+  loop_init();
+
+  if (worker_addr) {
+    remote_serve(worker_addr);
+  }
+
+  char *session_script = NULL;
 
-  do {
+  if (server_socket)
+  {
+    session_script = server_run(server_socket);
+    nscripts = session_script != NULL;
+    scripts = &session_script;
+  }
+
+  if (parallel_scripts > 0 && nscripts > 0)
+  {
+    scripts = run_scripts(nscripts, scripts);
+    nscripts = 1;
+  }
+
+  autoclose int fd = set_input_source(nscripts, scripts);
+
+  if (fd != -1 && use_compiled_scripts) {
+    run_compiled(scripts[0]);
+  }
+
+  if (fd != -1 && readahead_window > 0) {
+    run_readahead();
+  }
+
+  if (fd != -1 && parseahead_depth > 0) {
+    start_parse_ahead();
+  }
+
+  while (true) {
     if (fd == -1) {
       printf("%s", prompt);
+      fflush(stdout);
     }
 
+    loop_wait_input(STDIN_FILENO);
+
     let ncmds = 0;
     let cmds = read_commands(&ncmds);
 
@@ -39,18 +146,97 @@ int main(int argc, char **argv)
     printcmds(cmds, ncmds);
     eval(cmds, ncmds);
     destruct(cmds, ncmds);
-  } while(fd == -1);
+    profile_line_end();
+  }
 
   return 0;
 }
 
-int set_input_source(int argc, char **argv)
+/* Long options without a short form */
+enum { OPT_PROFILE = 256, OPT_READAHEAD, OPT_PARSEAHEAD, OPT_WORKER, OPT_SERVER, OPT_STATS, OPT_RECORD };
+
+int parse_options(int argc, char **argv)
+{
+  static const struct option long_options[] = {
+    { "profile", optional_argument, NULL, OPT_PROFILE },
+    { "readahead", optional_argument, NULL, OPT_READAHEAD },
+    { "parseahead", optional_argument, NULL, OPT_PARSEAHEAD },
+    { "worker", required_argument, NULL, OPT_WORKER },
+    { "server", required_argument, NULL, OPT_SERVER },
+    { "stats", required_argument, NULL, OPT_STATS },
+    { "record", required_argument, NULL, OPT_RECORD },
+    { NULL, 0, NULL, 0 },
+  };
+
+  int opt;
+  let profile = false;
+  char *profile_prefix = NULL;
+
+  while ((opt = getopt_long(argc, argv, "+Cj:P:", long_options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+      case 'C':
+        use_compiled_scripts = true;
+        break;
+      case 'j':
+        max_jobs = strtol(optarg, NULL, 10);
+        break;
+      case 'P':
+        parallel_scripts = strtol(optarg, NULL, 10);
+        break;
+      case OPT_PROFILE:
+        profile = true;
+        profile_prefix = optarg;
+        break;
+      case OPT_READAHEAD:
+        readahead_window = optarg ? strtol(optarg, NULL, 10) : READAHEAD_DEFAULT_WINDOW;
+        break;
+      case OPT_PARSEAHEAD:
+        parseahead_depth = optarg ? strtol(optarg, NULL, 10) : PARSEAHEAD_DEFAULT_DEPTH;
+        break;
+      case OPT_WORKER:
+        worker_addr = optarg;
+        break;
+      case OPT_SERVER:
+        server_socket = optarg;
+        break;
+      case OPT_STATS:
+        stats_file = optarg;
+        break;
+      case OPT_RECORD:
+        trace_start(optarg);
+        break;
+      default:
+        scold_user("usage: %s [-C] [-j jobs] [-P scripts] [--profile[=prefix]] [--readahead[=window]] [--parseahead[=depth]] [--worker addr] [--server socket] [--stats file] [--record trace] [script...]", argv[0]);
+        exit(1);
+    }
+  }
+
+  if (profile) {
+    profile_start(profile_prefix, optind < argc ? argv[optind] : NULL);
+  }
+
+  if (max_jobs <= 0) {
+    max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  return optind;
+}
+
+int set_input_source(int nscripts, char **scripts)
 {
   let fd = -1;
 
-  if (argc == 2)
+  if (nscripts > 1)
+  {
+    scold_user("utcsh takes at most one script file, unless run with -P");
+    exit(1);
+  }
+
+  if (nscripts == 1)
   {
-    fd = open(argv[1], O_RDONLY);
+    fd = open(scripts[0], O_RDONLY);
 
     if (fd == -1) {
       ppanic("open");
@@ -64,49 +250,246 @@ int set_input_source(int argc, char **argv)
   return fd;
 }
 
+/* Reads the next line of input without its newline, or returns NULL at EOF.
+   Must be freed by the caller. */
+static char *read_line(void)
+{
+  return loop_read_line(STDIN_FILENO);
+}
+
+static bool is_builtin(const char *name)
+{
+  for (CommandFn *fn = functions; fn->name; fn++)
+  {
+    if (strcmp(fn->name, name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Parse-ahead: a ring buffer of lines that were read and parsed while the
+   lines before them were still running */
+typedef struct ParsedLine {
+  char *text;
+  Command *cmds;
+  int ncmds;
+} ParsedLine;
+
+static struct {
+  ParsedLine *lines;
+  size_t size;
+  size_t head;
+  size_t count;
+  bool eof;
+  bool at_barrier;
+} parsed;
+
+#define PARSED(i) (parsed.lines + (parsed.head + (i)) % parsed.size)
+
+/* The loop's idle work in parse-ahead mode: reads and parses one more line,
+   and resolves the executables it runs while we're at it. Stops after a `cd`
+   or `path` line until that has run, since it changes what names resolve to.
+   Parse errors are kept quiet here and reported once the line is reached. */
+static bool parse_ahead(void)
+{
+  if (parsed.eof || parsed.at_barrier || parsed.count == parsed.size) {
+    return false;
+  }
+
+  let text = read_line();
+
+  if (!text)
+  {
+    parsed.eof = true;
+    return false;
+  }
+
+  let line = PARSED(parsed.count++);
+  autofree char *copy = strdup(text);
+
+  *line = (ParsedLine){ .text = text };
+  parse_quietly = true;
+  line->cmds = parse_commands(copy, &line->ncmds);
+  parse_quietly = false;
+
+  for (let i = 0; line->cmds && i < line->ncmds; i++)
+  {
+    let name = line->cmds[i].argv[0];
+
+    if (!name) {
+      continue;
+    }
+
+    if (strcmp(name, "cd") == 0 || strcmp(name, "path") == 0) {
+      parsed.at_barrier = true;
+    } else if (!is_builtin(name) && !is_absolute_path(name)) {
+      exe_cache_add(name);
+    }
+  }
+
+  return true;
+}
+
+void start_parse_ahead(void)
+{
+  parsed.size = parseahead_depth;
+  parsed.lines = calloc(parsed.size, sizeof(ParsedLine));
+
+  if (!parsed.lines) {
+    ppanic("calloc");
+  }
+
+  loop_set_idle(parse_ahead);
+}
+
+static Command *next_parsed(int *ncmds, unsigned lineno)
+{
+  /* Everything handed out before has run by now, including any barrier */
+  if (parsed.count == 0)
+  {
+    parsed.at_barrier = false;
+    parse_ahead();
+  }
+
+  if (parsed.count == 0) {
+    exit(0);
+  }
+
+  let line = PARSED(0);
+  autofree char *text = line->text;
+  let cmds = line->cmds;
+
+  parsed.head = (parsed.head + 1) % parsed.size;
+  parsed.count--;
+  *ncmds = line->ncmds;
+
+  profile_line_begin(lineno, text);
+
+  if (!cmds)
+  {
+    autofree char *copy = strdup(text);
+    cmds = parse_commands(copy, ncmds);
+  }
+
+  profile_line_parsed(cmds, *ncmds);
+  return cmds;
+}
+
 Command *read_commands(int *ncmds) 
 {
-  size_t n = 0;
-  autofree char *buffer = NULL;
+  static unsigned lineno = 0;
+
+  if (parsed.size) {
+    return next_parsed(ncmds, ++lineno);
+  }
+
+  autofree char *buffer = read_line();
+
+  if (!buffer) {
+    exit(0);
+  }
 
-  let nread = getline(&buffer, &n, stdin);
+  profile_line_begin(++lineno, buffer);
+  let cmds = parse_commands(buffer, ncmds);
+  profile_line_parsed(cmds, *ncmds);
 
-  if (nread == -1) {
-    exit_builtin(0);
+  return cmds;
+}
+
+/* The operator starting at `p`, if any, and how many characters it takes up.
+   `&&` and `||` are checked first so that they aren't read as two `&`s. */
+static bool parse_connector(const char *p, Connector *next, int *len)
+{
+  if (p[0] == '&' && p[1] == '&') {
+    *next = CONNECT_AND;
+  } else if (p[0] == '|' && p[1] == '|') {
+    *next = CONNECT_OR;
+  } else if (*p == '&') {
+    *next = CONNECT_PAR;
+  } else if (*p == ';') {
+    *next = CONNECT_SEQ;
+  } else {
+    return false;
   }
 
-  if (buffer[nread - 1] == '\n') {
-    buffer[nread - 1] = '\0';
+  *len = (*next == CONNECT_AND || *next == CONNECT_OR) ? 2 : 1;
+  return true;
+}
+
+static bool is_blank(const char *text)
+{
+  for (; *text; text++)
+  {
+    if (!isspace((unsigned char)*text)) {
+      return false;
+    }
   }
 
-  return parse_commands(buffer, ncmds);
+  return true;
 }
 
+/* Blank commands between operators are dropped, along with the weaker of the
+   operators around them, so `a & & b` is `a & b` and `a && ; b` is `a ; b`.
+   Returns NULL if the line has no commands at all. */
 Command *parse_commands(char *cmdline, int *ncmds) 
 {
-  char *cmdtokstate;
+  let capacity = 1;
 
-  *ncmds = 1;
-  for (size_t i = 0; i < strlen(cmdline); i++)
+  for (let p = cmdline; *p; p++)
   {
-    *ncmds += (cmdline[i] == '&');
+    capacity += (*p == '&' || *p == '|' || *p == ';');
   }
 
-  Command *commands = calloc(*ncmds, sizeof(Command));
-  char *cmdtxt = strtok_r(cmdline, "&", &cmdtokstate);
+  Command *commands = calloc(capacity, sizeof(Command));
+  let segment = cmdline;
 
-  if (cmdtxt == NULL) {
-    return NULL;
-  }
+  *ncmds = 0;
 
-  for (let i = 0; i < *ncmds; i++) 
+  for (let p = cmdline; true; p++)
   {
-    if (!parse_command(cmdtxt, commands + i)) {
-      return NULL;
+    Connector next = CONNECT_END;
+    int len = 0;
+
+    if (*p && !parse_connector(p, &next, &len)) {
+      continue;
+    }
+
+    let at_end = *p == '\0';
+    *p = '\0';
+
+    if (!is_blank(segment))
+    {
+      if (!parse_command(segment, commands + *ncmds))
+      {
+        destruct(commands, *ncmds);
+        return NULL;
+      }
+
+      commands[(*ncmds)++].next = next;
+    }
+    else if (*ncmds > 0 && next > commands[*ncmds - 1].next)
+    {
+      commands[*ncmds - 1].next = next;
+    }
+
+    if (at_end) {
+      break;
     }
-    cmdtxt = strtok_r(NULL, "&", &cmdtokstate);
+
+    p += len - 1;
+    segment = p + 1;
+  }
+
+  if (*ncmds == 0)
+  {
+    free(commands);
+    return NULL;
   }
 
+  commands[*ncmds - 1].next = CONNECT_END;
+  stats_add(commands_parsed, *ncmds);
   return commands;
 }
 
@@ -115,191 +498,1618 @@ bool parse_command(char *cmdtxt, Command *cmd)
   let token = strtok(cmdtxt, " ");
 
   let nargs = 0;
-  let hasRedirect = false;
+  let capacity = 0;
+  let nextra = 0;
 
   while (token)
   {
     if (strcmp(token, ">") == 0)
     {
-      if (hasRedirect)
+      token = strtok(NULL, " ");
+
+      if (token == NULL)
       {
-        scold_user("Single command can't have multiple redirects smh");
+        parse_error("Redirect needs a file to write to");
         return false;
       }
 
-      token = strtok(NULL, " ");
-      cmd->outputFile = strdup(token);
-      hasRedirect = true;
+      if (cmd->outputFile == NULL)
+      {
+        cmd->outputFile = strdup(token);
+      }
+      else
+      {
+        /* `cmd > a > b`: the output goes to both */
+        cmd->extraOutputs = realloc(cmd->extraOutputs, (nextra + 2) * sizeof(char*));
+        cmd->extraOutputs[nextra++] = strdup(token);
+        cmd->extraOutputs[nextra] = NULL;
+      }
     } 
     else 
     {
-      cmd->argv = realloc(cmd->argv, (nargs + 1) * sizeof(char*));
+      // +1 so that there is always room left for the NULL terminator
+      if (nargs + 1 >= capacity)
+      {
+        capacity = capacity ? capacity * 2 : 8;
+        cmd->argv = realloc(cmd->argv, capacity * sizeof(char*));
+      }
       cmd->argv[nargs] = strdup(token);
       nargs++;
     }
     token = strtok(NULL, " ");
   }
 
-  cmd->argv = realloc(cmd->argv, (nargs + 1) * sizeof(char*));
+  if (capacity == 0) {
+    cmd->argv = realloc(cmd->argv, sizeof(char*));
+  }
   cmd->argv[nargs] = NULL;
 
   cmd->argc = nargs - 1;
   return true;
 }
 
-void eval(Command *cmd, int ncmds)
+/* In spread mode, pins the background job `i` of a line to one of the shell's
+   CPUs, round-robin, so that a wide `&` fan-out doesn't pile onto (and evict
+   the caches of) whatever core the foreground job is running on. Called in
+   the job's child, so everything it runs inherits the mask. */
+static void spread_job(int i)
 {
-  for (let i = 0; i < ncmds; i++)
-  {
-    let doInBackground = i < (ncmds - 1);
+  cpu_set_t allowed, mine;
 
-    if (doInBackground) 
-    {
-      if (fork() == CHILD_PROCESS)
-      {
-        exec_single(cmd + i);
-        exit(0);
-      }
-    }
-    else
-    {
-      exec_single(cmd + i);
-    }
+  if (!spread_jobs || sched_getaffinity(0, sizeof allowed, &allowed) == -1) {
+    return;
   }
 
-  for (let i = 0; i < ncmds - 1; i++)
+  let target = i % CPU_COUNT(&allowed);
+
+  for (let cpu = 0; cpu < CPU_SETSIZE; cpu++)
   {
-    wait(NULL);
+    if (CPU_ISSET(cpu, &allowed) && target-- == 0)
+    {
+      CPU_ZERO(&mine);
+      CPU_SET(cpu, &mine);
+      sched_setaffinity(0, sizeof mine, &mine);
+      return;
+    }
   }
 }
 
-int original_stdout;
+static int status_to_exit_code(int status)
+{
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
 
-__attribute__((constructor))
-void initialize() 
+/* Accounts for the time the shell spent forking a child, from `started` */
+static void spawned(uint64_t started)
 {
-  original_stdout = dup(STDOUT_FILENO);
+  let ns = now_ns() - started;
 
-  if (original_stdout == -1) {
-    ppanic("Failed to duplicate stdout");
-  }
+  profile_add_spawn(ns);
+  stats_record(&stats->spawn, ns);
 }
 
-void exec_single(Command *cmd)
-{
-  for (CommandFn *fn = functions; true; fn++)
-  {
-    if (fn->name == NULL || strcmp(*cmd->argv, fn->name) == 0)
-    {
-      autoclose int fd = -1;
+/* Everything one member of a `&` line wrote, held until it is its turn */
+typedef struct Capture {
+  int out;
+  int err;
+  Child child;
+} Capture;
 
-      if (cmd->outputFile != NULL) {
-        fd = redirectStdout(cmd->outputFile);
+static void capture_open(Capture *cap)
+{
+  cap->out = memfd_create("utcsh-stdout", MFD_CLOEXEC);
+  cap->err = memfd_create("utcsh-stderr", MFD_CLOEXEC);
 
-        if (fd == -1) {
-          return scold_user("Error writing to file '%s'", cmd->outputFile);
-        }
-      }
+  if (cap->out == -1 || cap->err == -1) {
+    ppanic("memfd_create");
+  }
+}
 
-      fn->execute(cmd);
+static void capture_flush(Capture *cap)
+{
+  copy_fd(cap->out, STDOUT_FILENO);
+  copy_fd(cap->err, STDERR_FILENO);
+  close(cap->out);
+  close(cap->err);
+}
 
-      if (fd != -1) {
-        unredirectStdout();
-      }
+/* The number of commands in the and-or chain starting at `cmd` */
+static int chain_length(Command *cmd, int ncmds)
+{
+  let n = 1;
 
-      return;
-    }
+  while (n < ncmds && (cmd[n - 1].next == CONNECT_AND || cmd[n - 1].next == CONNECT_OR)) {
+    n++;
   }
+
+  return n;
 }
 
-int redirectStdout(const char *outputFile) 
+/* Runs an and-or chain: a command after `&&` only runs if the one before it
+   succeeded, and after `||` only if it failed. A skipped command leaves the
+   status alone, so in `a || b && c`, c still runs when a succeeds. */
+static void run_chain(Command *cmd, int n)
 {
-    let fd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-      ppanic("Failed to open file");
+  exec_single(cmd);
+
+  for (let i = 1; i < n; i++)
+  {
+    if ((cmd[i - 1].next == CONNECT_AND) == (last_status == 0)) {
+      exec_single(cmd + i);
     }
-    dup2(fd, STDOUT_FILENO);
-    return fd;
+  }
 }
 
-void unredirectStdout()
+/* A group's status: its foreground chain's, or if that succeeded, that of
+   the first of its jobs to have failed */
+static void set_group_status(int foreground, int *jobs, int njobs)
 {
-    dup2(original_stdout, STDOUT_FILENO);
+  last_status = foreground;
+
+  for (let i = 0; i < njobs && last_status == 0; i++)
+  {
+    last_status = jobs[i];
+  }
 }
 
-void destruct(Command *cmds, int ncmds)
+/* eval for keep-order mode: every job of the group writes into its own pair
+   of memfds instead of the terminal, and the buffers are copied out in job
+   order, each as soon as it and everything before it have finished. The last
+   chain still runs in the shell itself (so `cd` and friends keep working),
+   just with its output captured the same way. */
+static void eval_ordered(Command *cmd, int ncmds, int nchains)
 {
-  for (let i = 0; i < ncmds; i++)
+  autofree Capture *caps = calloc(nchains, sizeof(Capture));
+  autofree int *statuses = calloc(nchains, sizeof(int));
+
+  if (!caps || !statuses) {
+    ppanic("calloc");
+  }
+
+  for (let c = 0; c < nchains - 1; c++)
   {
-    let cmd = cmds + i;
+    let len = chain_length(cmd, ncmds);
 
-    for (let j = 0; j < cmd->argc + 1; j++)
+    capture_open(caps + c);
+    let started = now_ns();
+    let pid = loop_fork();
+
+    if (pid == CHILD_PROCESS)
     {
-      free(cmd->argv[j]);
+      /* original_stdout too, so that unredirecting after `>` comes back
+         to the capture */
+      if (dup2(caps[c].out, STDOUT_FILENO) == -1 || dup2(caps[c].out, original_stdout) == -1
+          || dup2(caps[c].err, STDERR_FILENO) == -1) {
+        ppanic("dup2");
+      }
+
+      spread_job(c);
+      run_chain(cmd, len);
+      fflush(stdout);
+      _exit(last_status);
     }
 
-    free(cmd->argv);
-    free(cmd->outputFile);
+    spawned(started);
+    child_watch(&caps[c].child, pid);
+    cmd += len;
+    ncmds -= len;
   }
 
-  free(cmds);
-}
+  let last = caps + nchains - 1;
+  autoclose int saved_out = dup(STDOUT_FILENO);
+  autoclose int saved_err = dup(STDERR_FILENO);
+  autoclose int saved_original = dup(original_stdout);
 
-void exit_builtin(Command *cmd)
-{
-  if (cmd->argc != 0) {
-    return scold_user("'exit' doesn't take any arguments");
+  if (saved_out == -1 || saved_err == -1 || saved_original == -1) {
+    ppanic("dup");
   }
 
-  exit(0);
-}
+  capture_open(last);
+  fflush(stdout);
 
-void cd_builtin(Command *cmd) 
-{
-  if (cmd->argc != 1) {
-    return scold_user("'cd' requires one argument");
+  if (dup2(last->out, STDOUT_FILENO) == -1 || dup2(last->out, original_stdout) == -1
+      || dup2(last->err, STDERR_FILENO) == -1) {
+    ppanic("dup2");
   }
 
-  let ret = chdir(cmd->argv[1]);
+  run_chain(cmd, ncmds);
+  fflush(stdout);
 
-  if (ret == -1) {
-    scold_user("failed to change directories");
+  if (dup2(saved_out, STDOUT_FILENO) == -1 || dup2(saved_original, original_stdout) == -1
+      || dup2(saved_err, STDERR_FILENO) == -1) {
+    ppanic("dup2");
   }
-}
 
-void path_builtin(Command *cmd)
-{
-  set_shell_path(cmd->argv + 1);
-}
+  last->child.done = true;
+  let foreground = last_status;
 
-void toggledebug_builtin(unused Command *cmd)
-{
-  in_debug_mode = !in_debug_mode;
-}
+  for (let flushed = 0; flushed < nchains; )
+  {
+    while (flushed < nchains && caps[flushed].child.done) {
+      capture_flush(caps + flushed++);
+    }
 
-void external_builtin(Command *cmd)
-{
-  let pid = fork();
+    if (flushed < nchains) {
+      loop_run_once();
+    }
+  }
 
-  if (pid == CHILD_PROCESS)
+  for (let c = 0; c < nchains - 1; c++)
   {
-    char *path = (is_absolute_path(cmd->argv[0]))
-      ? cmd->argv[0]
-      : find_exe(cmd->argv[0]);
+    statuses[c] = status_to_exit_code(caps[c].child.status);
+  }
+
+  set_group_status(foreground, statuses, nchains - 1);
+}
+
+/* A copy of `argv` with every `$?` replaced by the last status, or NULL if
+   there are none */
+static char **expand_status(char **argv)
+{
+  let n = 0;
+  let found = false;
+
+  for (; argv[n]; n++)
+  {
+    found |= strstr(argv[n], STATUS_VAR) != NULL;
+  }
+
+  if (!found) {
+    return NULL;
+  }
+
+  char **expanded = calloc(n + 1, sizeof(char*));
+
+  if (!expanded) {
+    ppanic("calloc");
+  }
+
+  for (let i = 0; i < n; i++)
+  {
+    size_t len = 0;
+    FILE *out = open_memstream(expanded + i, &len);
+
+    if (!out) {
+      ppanic("open_memstream");
+    }
+
+    for (let word = argv[i]; *word; )
+    {
+      let var = strstr(word, STATUS_VAR);
+
+      if (!var)
+      {
+        fputs(word, out);
+        break;
+      }
+
+      fprintf(out, "%.*s%d", (int)(var - word), word, last_status);
+      word = var + strlen(STATUS_VAR);
+    }
+
+    fclose(out);
+  }
+
+  return expanded;
+}
+
+static void free_words(char ***words)
+{
+  for (let word = *words; word && *word; word++)
+  {
+    free(*word);
+  }
+
+  free(*words);
+}
+
+/* remote_start, with `$?` expanded here: the worker has a status of its own */
+static bool start_remote(RemoteJob *job, Command *cmd)
+{
+  __attribute__((cleanup(free_words))) char **expanded = expand_status(cmd->argv);
+  Command with_status = *cmd;
+
+  if (expanded) {
+    with_status.argv = expanded;
+  }
+
+  return remote_start(job, &with_status);
+}
+
+/* Runs one `;`-separated group of a line: every chain but the last is forked
+   off (or sent to a worker, if it is a single command) to run alongside the
+   last, which runs in the shell itself, and then all of them are waited for */
+static void eval_group(Command *cmd, int ncmds)
+{
+  let nchains = 1;
+
+  for (let i = 0; i < ncmds - 1; i++)
+  {
+    nchains += (cmd[i].next == CONNECT_PAR);
+  }
+
+  if (keep_order && nchains > 1) {
+    return eval_ordered(cmd, ncmds, nchains);
+  }
+
+  autofree Child *background = calloc(nchains, sizeof(Child));
+  autofree int *statuses = calloc(nchains, sizeof(int));
+  autofree RemoteJob *remote = remote_enabled() ? calloc(nchains, sizeof(RemoteJob)) : NULL;
+
+  if (!background || !statuses || (remote_enabled() && !remote)) {
+    ppanic("calloc");
+  }
+
+  let i = 0;
+
+  for (let c = 0; c < nchains; c++)
+  {
+    let chain = cmd + i;
+    let len = chain_length(chain, ncmds - i);
+    let doInBackground = c < nchains - 1;
+
+    i += len;
+
+    if (remote) {
+      remote[c].fd = -1;
+    }
+
+    if (doInBackground && remote && len == 1 && start_remote(remote + c, chain)) {
+      continue;
+    }
+
+    if (doInBackground) 
+    {
+      let started = now_ns();
+      let pid = loop_fork();
+
+      if (pid == CHILD_PROCESS)
+      {
+        spread_job(c);
+        run_chain(chain, len);
+        fflush(stdout);
+        _exit(last_status);
+      }
+
+      spawned(started);
+      child_watch(background + c, pid);
+    }
+    else
+    {
+      run_chain(chain, len);
+    }
+  }
+
+  let foreground = last_status;
+
+  for (let c = 0; c < nchains - 1; c++)
+  {
+    if (remote && remote[c].fd != -1) {
+      statuses[c] = remote_wait(remote + c);
+    } else {
+      statuses[c] = status_to_exit_code(child_wait(background + c));
+    }
+  }
+
+  set_group_status(foreground, statuses, nchains - 1);
+}
+
+void eval(Command *cmd, int ncmds)
+{
+  /* `;` splits a line into groups that run as if they were lines of their
+     own */
+  let start = 0;
+
+  for (let i = 0; i < ncmds; i++)
+  {
+    if (cmd[i].next == CONNECT_SEQ || i == ncmds - 1)
+    {
+      eval_group(cmd + start, i + 1 - start);
+      start = i + 1;
+    }
+  }
+}
+
+/* Builtins that only wrap the command after them, and so are as safe to run
+   out of line as that command is */
+static bool is_prefix_builtin(const char *name)
+{
+  static const char *prefixes[] = { "timeout", "retry", "pin", "prio", "ioprio", "cache", NULL };
+
+  for (let prefix = prefixes; *prefix; prefix++)
+  {
+    if (strcmp(*prefix, name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* A line in the read-ahead window */
+typedef struct AheadLine {
+  char *text;
+  Command *cmds;
+  int ncmds;
+  bool barrier;
+  bool started;
+  Capture cap;
+  /* For the profile and trace hooks */
+  unsigned lineno;
+  uint64_t parse_ns;
+  uint64_t started_ns;
+  uint64_t spawn_ns;
+} AheadLine;
+
+/* Barriers are lines that have to run in the shell itself, once everything
+   before them is finished: anything that changes the shell's own state (`cd`,
+   `path`, the toggles, `exit`), lines that use `$?` and so depend on the
+   status of the line before, and lines that fail to parse, so that their
+   error comes out in the right place. */
+static bool is_barrier(Command *cmds, int ncmds)
+{
+  if (!cmds) {
+    return true;
+  }
+
+  for (let i = 0; i < ncmds; i++)
+  {
+    let argv = cmds[i].argv;
+
+    if (!argv[0] || (is_builtin(argv[0]) && !is_prefix_builtin(argv[0]))) {
+      return true;
+    }
+
+    for (let j = 0; argv[j]; j++)
+    {
+      if (strstr(argv[j], STATUS_VAR)) {
+        return true;
+      }
+    }
+
+    for (let j = 1; is_prefix_builtin(argv[0]) && argv[j]; j++)
+    {
+      if (is_builtin(argv[j]) && !is_prefix_builtin(argv[j])) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+/* The `i`th name of a command that lines_share_word compares: its redirect
+   targets, then its argv. NULL past the end. */
+static char *name_at(Command *cmd, int i)
+{
+  if (cmd->outputFile && i-- == 0) {
+    return cmd->outputFile;
+  }
+
+  for (let out = cmd->extraOutputs; out && *out; out++)
+  {
+    if (i-- == 0) {
+      return *out;
+    }
+  }
+
+  return cmd->argv[i];
+}
+
+/* Whether two lines name any of the same files, i.e. might depend on each
+   other. Everything that isn't an option counts, as well as redirect targets;
+   so do the commands themselves when given as a path, since an earlier line
+   may be what creates them. */
+static bool lines_share_word(Command *a, int na, Command *b, int nb)
+{
+  for (let i = 0; i < na; i++)
+  {
+    for (let j = 0; j < nb; j++)
+    {
+      for (let wa = 0; name_at(a + i, wa); wa++)
+      {
+        let x = name_at(a + i, wa);
+
+        if (*x == '-' || (x == a[i].argv[0] && !strchr(x, '/'))) {
+          continue;
+        }
+
+        for (let wb = 0; name_at(b + j, wb); wb++)
+        {
+          if (strcmp(x, name_at(b + j, wb)) == 0) {
+            return true;
+          }
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+static void ahead_start(AheadLine *line)
+{
+  capture_open(&line->cap);
+  line->started_ns = now_ns();
+  let pid = loop_fork();
+
+  if (pid == CHILD_PROCESS)
+  {
+    if (dup2(line->cap.out, STDOUT_FILENO) == -1 || dup2(line->cap.out, original_stdout) == -1
+        || dup2(line->cap.err, STDERR_FILENO) == -1) {
+      ppanic("dup2");
+    }
+
+    printcmds(line->cmds, line->ncmds);
+    eval(line->cmds, line->ncmds);
+    fflush(stdout);
+    _exit(last_status);
+  }
+
+  line->spawn_ns = now_ns() - line->started_ns;
+  stats_record(&stats->spawn, line->spawn_ns);
+  child_watch(&line->cap.child, pid);
+  line->started = true;
+}
+
+static void ahead_free(AheadLine *line)
+{
+  if (line->cmds) {
+    destruct(line->cmds, line->ncmds);
+  }
+  free(line->text);
+}
+
+void run_readahead(void)
+{
+  let window_size = (size_t)readahead_window;
+  AheadLine *window = calloc(window_size, sizeof(AheadLine));
+  size_t head = 0;
+  size_t count = 0;
+  unsigned lineno = 0;
+  let eof = false;
+
+  if (!window) {
+    ppanic("calloc");
+  }
+
+  #define AHEAD(i) (window + (head + (i)) % window_size)
+
+  while (true)
+  {
+    /* Nothing after a barrier can be looked at until it has run, since it
+       may change the directory or path the later lines depend on */
+    while (!eof && count < window_size && !(count && AHEAD(count - 1)->barrier))
+    {
+      let read_ns = now_ns();
+      let text = read_line();
+
+      if (!text)
+      {
+        eof = true;
+        break;
+      }
+
+      lineno++;
+
+      if (text[strspn(text, " ")] == '\0')
+      {
+        free(text);
+        continue;
+      }
+
+      let line = AHEAD(count);
+      autofree char *copy = strdup(text);
+
+      *line = (AheadLine){ .text = text, .lineno = lineno };
+      parse_quietly = true;
+      line->cmds = parse_commands(copy, &line->ncmds);
+      parse_quietly = false;
+      line->parse_ns = now_ns() - read_ns;
+      line->barrier = is_barrier(line->cmds, line->ncmds);
+      count++;
+    }
+
+    if (count == 0) {
+      exit(0);
+    }
+
+    let progressed = false;
+
+    /* Output is passed on in script order... */
+    while (count && AHEAD(0)->started && AHEAD(0)->cap.child.done)
+    {
+      let line = AHEAD(0);
+      ForkedLine forked = {
+        .lineno = line->lineno,
+        .text = line->text,
+        .started_ns = line->started_ns,
+        .parse_ns = line->parse_ns,
+        .spawn_ns = line->spawn_ns,
+        .child = &line->cap.child,
+      };
+
+      capture_flush(&line->cap);
+      last_status = status_to_exit_code(line->cap.child.status);
+      profile_line_forked(&forked, line->cmds, line->ncmds);
+      ahead_free(line);
+      head = (head + 1) % window_size;
+      count--;
+      progressed = true;
+    }
+
+    /* ...but a line gives up its -j slot as soon as it exits */
+    let running = 0L;
+
+    for (size_t i = 0; i < count; i++)
+    {
+      running += AHEAD(i)->started && !AHEAD(i)->cap.child.done;
+    }
+
+    if (count && AHEAD(0)->barrier)
+    {
+      autofree char *copy = strdup(AHEAD(0)->text);
+      let ncmds = 0;
+
+      profile_line_begin(AHEAD(0)->lineno, AHEAD(0)->text);
+      let cmds = parse_commands(copy, &ncmds);
+      profile_line_parsed(cmds, ncmds);
+
+      if (cmds)
+      {
+        printcmds(cmds, ncmds);
+        eval(cmds, ncmds);
+        destruct(cmds, ncmds);
+        profile_line_end();
+      }
+
+      ahead_free(AHEAD(0));
+      head = (head + 1) % window_size;
+      count--;
+      continue;
+    }
+
+    /* Start every line that doesn't share a file with an unfinished line
+       before it, stopping at the first barrier */
+    for (size_t i = 0; i < count && running < max_jobs && !AHEAD(i)->barrier; i++)
+    {
+      let line = AHEAD(i);
+      let blocked = false;
+
+      for (size_t j = 0; j < i && !blocked && !line->started; j++)
+      {
+        let before = AHEAD(j);
+
+        blocked = !(before->started && before->cap.child.done)
+          && lines_share_word(before->cmds, before->ncmds, line->cmds, line->ncmds);
+      }
+
+      if (!line->started && !blocked)
+      {
+        ahead_start(line);
+        running++;
+        progressed = true;
+      }
+    }
+
+    if (!progressed) {
+      loop_run_once();
+    }
+  }
+
+  #undef AHEAD
+}
+
+int original_stdout;
+
+__attribute__((constructor))
+void initialize() 
+{
+  original_stdout = dup(STDOUT_FILENO);
+
+  if (original_stdout == -1) {
+    ppanic("Failed to duplicate stdout");
+  }
+}
+
+/* Creates or truncates `path`, as a redirect with no command does */
+static bool truncate_output(const char *path)
+{
+  let fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+  if (fd == -1)
+  {
+    builtin_error("Error writing to file '%s'", path);
+    return false;
+  }
+
+  close(fd);
+  return true;
+}
+
+/* A line that is only a redirect, such as `> f`, creates or truncates its
+   files as sh would, and runs nothing */
+static void exec_redirect_only(Command *cmd)
+{
+  last_status = 0;
+
+  if (!cmd->outputFile || !truncate_output(cmd->outputFile)) {
+    return;
+  }
+
+  for (let out = cmd->extraOutputs; out && *out && truncate_output(*out); out++)
+    ;
+}
+
+void exec_single(Command *cmd)
+{
+  if (!cmd->argv[0]) {
+    return exec_redirect_only(cmd);
+  }
+
+  __attribute__((cleanup(free_words))) char **expanded = expand_status(cmd->argv);
+  Command with_status;
+
+  if (expanded)
+  {
+    with_status = *cmd;
+    with_status.argv = expanded;
+    cmd = &with_status;
+  }
+
+  for (CommandFn *fn = functions; true; fn++)
+  {
+    if (fn->name == NULL || strcmp(*cmd->argv, fn->name) == 0)
+    {
+      autoclose int fd = -1;
+      Child copier = { .done = true };
+
+      /* Builtins print through stdio, so nothing may sit in its buffer
+         across a change of what stdout is */
+      if (cmd->outputFile != NULL) {
+        fflush(stdout);
+        fd = cmd->extraOutputs ? fanoutStdout(cmd, &copier) : redirectStdout(cmd->outputFile);
+
+        if (fd == -1) {
+          return builtin_error("Error writing to file '%s'", cmd->outputFile);
+        }
+      }
+
+      /* Externals set their own status once they have been waited for */
+      if (fn->name)
+      {
+        last_status = 0;
+        stats_add(builtins, 1);
+      }
+      else
+      {
+        stats_add(externals, 1);
+      }
+
+      fn->execute(cmd);
+
+      if (fd != -1) {
+        fflush(stdout);
+        unredirectStdout();
+      }
+
+      /* The copier only sees EOF once our end of its pipe is gone too */
+      if (!copier.done)
+      {
+        close(fd);
+        fd = -1;
+        child_wait(&copier);
+      }
+
+      return;
+    }
+  }
+}
+
+int redirectStdout(const char *outputFile) 
+{
+    let fd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      ppanic("Failed to open file");
+    }
+    dup2(fd, STDOUT_FILENO);
+    return fd;
+}
+
+void unredirectStdout()
+{
+    dup2(original_stdout, STDOUT_FILENO);
+}
+
+/* Moves exactly `len` bytes from the pipe `from` to `to`, which splice(2)
+   can't write to if it is, say, opened for appending or a tty on an older
+   kernel; the rest then goes through a buffer instead */
+static bool fanout_move(int from, int to, size_t len)
+{
+  while (len > 0)
+  {
+    let n = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+
+    if (n == -1 && errno == EINVAL)
+    {
+      char buf[FANOUT_CHUNK];
+      n = read(from, buf, len < sizeof buf ? len : sizeof buf);
+
+      if (n > 0 && !write_full(to, buf, n)) {
+        return false;
+      }
+    }
+
+    if (n == 0 || (n == -1 && errno != EINTR)) {
+      return false;
+    }
+
+    len -= n > 0 ? n : 0;
+  }
+
+  return true;
+}
+
+/* Passes `len` bytes waiting in `pipes[stage]` on to file `stage` and, through
+   a tee into the next pipe, to every file after it */
+static bool fanout_pump(int (*pipes)[2], int *files, int nfiles, int stage, size_t len)
+{
+  if (stage == nfiles - 1) {
+    return fanout_move(pipes[stage][0], files[stage], len);
+  }
+
+  while (len > 0)
+  {
+    /* The next pipe is always empty here, so this only falls short if the
+       data is spread across more buffers than it has room for */
+    let n = tee(pipes[stage][0], pipes[stage + 1][1], len, 0);
+
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0
+        || !fanout_move(pipes[stage][0], files[stage], n)
+        || !fanout_pump(pipes, files, nfiles, stage + 1, n)) {
+      return false;
+    }
+
+    len -= n;
+  }
+
+  return true;
+}
+
+int fanoutStdout(Command *cmd, Child *copier)
+{
+  let nfiles = 1;
+
+  for (let out = cmd->extraOutputs; *out; out++) {
+    nfiles++;
+  }
+
+  int files[nfiles];
+  int pipes[nfiles][2];
+
+  for (let i = 0; i < nfiles; i++)
+  {
+    let name = i ? cmd->extraOutputs[i - 1] : cmd->outputFile;
+    files[i] = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+    if (files[i] == -1) {
+      ppanic("Failed to open file");
+    }
+
+    if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+      ppanic("pipe");
+    }
+  }
+
+  let pid = fork();
+
+  if (pid == CHILD_PROCESS)
+  {
+    close(pipes[0][1]);
+
+    for (;;)
+    {
+      /* Blocks until the command writes something, and is 0 at EOF */
+      let n = tee(pipes[0][0], pipes[1][1], FANOUT_CHUNK, 0);
+
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+
+      if (n <= 0
+          || !fanout_move(pipes[0][0], files[0], n)
+          || !fanout_pump(pipes, files, nfiles, 1, n)) {
+        _exit(n == 0 ? 0 : 1);
+      }
+    }
+  }
+
+  child_watch(copier, pid);
+
+  for (let i = 0; i < nfiles; i++)
+  {
+    close(files[i]);
+    close(pipes[i][0]);
+
+    if (i > 0) {
+      close(pipes[i][1]);
+    }
+  }
+
+  dup2(pipes[0][1], STDOUT_FILENO);
+  return pipes[0][1];
+}
+
+void destruct(Command *cmds, int ncmds)
+{
+  for (let i = 0; i < ncmds; i++)
+  {
+    let cmd = cmds + i;
+
+    for (let j = 0; j < cmd->argc + 1; j++)
+    {
+      free(cmd->argv[j]);
+    }
+
+    free(cmd->argv);
+    free(cmd->outputFile);
+
+    for (let out = cmd->extraOutputs; out && *out; out++)
+    {
+      free(*out);
+    }
+
+    free(cmd->extraOutputs);
+  }
+
+  free(cmds);
+}
+
+void exit_builtin(Command *cmd)
+{
+  if (cmd->argc != 0) {
+    return builtin_error("'exit' doesn't take any arguments");
+  }
+
+  exit(0);
+}
+
+void cd_builtin(Command *cmd) 
+{
+  if (cmd->argc != 1) {
+    return builtin_error("'cd' requires one argument");
+  }
+
+  let ret = chdir(cmd->argv[1]);
+
+  if (ret == -1) {
+    builtin_error("failed to change directories");
+  }
+
+  exe_cache_chdir();
+}
+
+void path_builtin(Command *cmd)
+{
+  set_shell_path(cmd->argv + 1);
+}
+
+void toggledebug_builtin(unused Command *cmd)
+{
+  in_debug_mode = !in_debug_mode;
+}
+
+void togglebatch_builtin(unused Command *cmd)
+{
+  batch_mode = !batch_mode;
+}
+
+void togglekeeporder_builtin(unused Command *cmd)
+{
+  keep_order = !keep_order;
+}
+
+/* Applies the `pin`, `prio` and `ioprio` modifiers to the calling process.
+   Failures (say, asking for a higher priority without the privileges for it)
+   are reported but not fatal: the command still runs, just unadjusted. */
+static void apply_scheduling(void)
+{
+  if (modifiers.pinned && sched_setaffinity(0, sizeof modifiers.cpus, &modifiers.cpus) == -1) {
+    perror("sched_setaffinity");
+  }
+
+  if (modifiers.reniced && setpriority(PRIO_PROCESS, 0, modifiers.nice) == -1) {
+    perror("setpriority");
+  }
+
+  if (modifiers.ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, modifiers.ioprio) == -1) {
+    perror("ioprio_set");
+  }
+}
+
+/* Moves the terminal on stdin from process group `from` to `to`, if `from`
+   has it. A `timeout` command runs in a group of its own, which has to be in
+   the foreground to read from the terminal or get its Ctrl-C. SIGTTOU is held
+   off, since the caller may be in a background group at the time. */
+static void pass_terminal(pid_t from, pid_t to)
+{
+  sigset_t ttou, old;
+
+  if (!isatty(STDIN_FILENO) || tcgetpgrp(STDIN_FILENO) != from) {
+    return;
+  }
+
+  sigemptyset(&ttou);
+  sigaddset(&ttou, SIGTTOU);
+  sigprocmask(SIG_BLOCK, &ttou, &old);
+  tcsetpgrp(STDIN_FILENO, to);
+  sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Under `timeout`, the command gets its own process group, so that a timeout
+   can take down everything it spawned, and takes the terminal with it. Both
+   the child and the shell do this, so that neither can run ahead of it. */
+static void own_process_group(void)
+{
+  let shell_group = getpgrp();
+  setpgid(0, 0);
+  pass_terminal(shell_group, getpid());
+}
+
+static void child_process_group(pid_t pid)
+{
+  setpgid(pid, pid);
+  pass_terminal(getpgrp(), pid);
+}
+
+/* Forks and execs argv, returning the pid of the child. If `counters` is
+   given, perf counters are attached to the child before it is allowed to exec;
+   until then it waits on `gate`, which the parent closes once they're open. */
+static pid_t spawn_external(char **argv, PerfCounters *counters)
+{
+  int gate[2] = { -1, -1 };
+
+  if (counters && pipe2(gate, O_CLOEXEC) == -1) {
+    counters = NULL;
+  }
+
+  let started = now_ns();
+  let pid = fork();
+
+  if (pid == CHILD_PROCESS)
+  {
+    if (counters)
+    {
+      char unused byte;
+      close(gate[1]);
+      while (read(gate[0], &byte, 1) == -1 && errno == EINTR)
+        ;
+    }
+
+    if (modifiers.timeout_ms) {
+      own_process_group();
+    }
+
+    apply_scheduling();
+
+    char *path = (is_absolute_path(argv[0]))
+      ? argv[0]
+      : find_exe(argv[0]);
 
     if (path == NULL) 
     {
-      scold_user("Could not find executable '%s'", cmd->argv[0]);
-      exit(1);
+      scold_user("Could not find executable '%s'", argv[0]);
+      _exit(1);
     }
 
-    cmd->argv[0] = path;
-    execv(cmd->argv[0], cmd->argv);
+    argv[0] = path;
+    loop_prepare_exec();
+    execv(argv[0], argv);
     perror("execv");
-    exit(1);
+    _exit(1);
+  }
+
+  if (pid != -1 && modifiers.timeout_ms) {
+    child_process_group(pid);
+  }
+
+  spawned(started);
+
+  if (counters)
+  {
+    perf_open(counters, pid);
+    close(gate[0]);
+    close(gate[1]);
+  }
+
+  return pid;
+}
+
+void warm_exe_cache(int nscripts, char **scripts)
+{
+  for (let i = 0; i < nscripts; i++)
+  {
+    FILE *in = fopen(scripts[i], "re");
+    autofree char *line = NULL;
+    size_t n = 0;
+    let barrier = false;
+
+    while (in && !barrier && getline(&line, &n, in) != -1)
+    {
+      line[strcspn(line, "\n")] = '\0';
+
+      let ncmds = 0;
+      parse_quietly = true;
+      let cmds = parse_commands(line, &ncmds);
+      parse_quietly = false;
+
+      for (let j = 0; cmds && j < ncmds; j++)
+      {
+        let name = cmds[j].argv[0];
+
+        if (!name) {
+          continue;
+        }
+
+        if (strcmp(name, "cd") == 0 || strcmp(name, "path") == 0) {
+          barrier = true;
+        } else if (!is_builtin(name) && !is_absolute_path(name)) {
+          exe_cache_add(name);
+        }
+      }
+
+      if (cmds) {
+        destruct(cmds, ncmds);
+      }
+    }
+
+    if (in) {
+      fclose(in);
+    }
+  }
+}
+
+char **run_scripts(int nscripts, char **scripts)
+{
+  autofree Capture *caps = calloc(nscripts, sizeof(Capture));
+  let started = 0;
+  let flushed = 0;
+  let failed = false;
+
+  if (!caps) {
+    ppanic("calloc");
+  }
+
+  exe_cache_index();
+  warm_exe_cache(nscripts, scripts);
+
+  while (flushed < nscripts)
+  {
+    let running = 0L;
+
+    for (let i = flushed; i < started; i++)
+    {
+      running += !caps[i].child.done;
+    }
+
+    for (; started < nscripts && running < parallel_scripts; started++, running++)
+    {
+      let cap = caps + started;
+      capture_open(cap);
+
+      let pid = loop_fork();
+
+      if (pid == CHILD_PROCESS)
+      {
+        /* original_stdout too, so that unredirecting after `>` comes back
+           to the capture rather than the real stdout */
+        if (dup2(cap->out, STDOUT_FILENO) == -1 || dup2(cap->out, original_stdout) == -1
+            || dup2(cap->err, STDERR_FILENO) == -1) {
+          ppanic("dup2");
+        }
+
+        for (let i = flushed; i <= started; i++)
+        {
+          close(caps[i].out);
+          close(caps[i].err);
+        }
+
+        return scripts + started;
+      }
+
+      child_watch(&cap->child, pid);
+    }
+
+    let progressed = false;
+
+    while (flushed < started && caps[flushed].child.done)
+    {
+      let cap = caps + flushed;
+      let code = status_to_exit_code(cap->child.status);
+
+      fflush(stdout);
+      capture_flush(cap);
+      scold_user("utcsh: %s: exit %d, %.3fs", scripts[flushed], code, (cap->child.ended_ns - cap->child.started_ns) / 1e9);
+
+      failed |= code != 0;
+      flushed++;
+      progressed = true;
+    }
+
+    if (!progressed) {
+      loop_run_once();
+    }
+  }
+
+  exit(failed);
+}
+
+/* Waits for a child started by spawn_external and records its status. Under
+   `timeout`, the child's process group gets SIGTERM when time runs out, and
+   SIGKILL if it is still around TIMEOUT_KILL_GRACE_MS later, and the shell
+   takes back the terminal if the group had it. */
+static void wait_external(pid_t pid)
+{
+  Child child;
+  child_watch(&child, pid);
+
+  if (!modifiers.timeout_ms)
+  {
+    last_status = status_to_exit_code(child_wait(&child));
+    return;
+  }
+
+  Timer timer = TIMER_INIT;
+  let signal = SIGTERM;
+
+  timer_start(&timer, modifiers.timeout_ms);
+
+  while (!child.done)
+  {
+    loop_run_once();
+
+    if (timer.fired && !child.done)
+    {
+      kill(-pid, signal);
+      signal = SIGKILL;
+      timer_start(&timer, TIMEOUT_KILL_GRACE_MS);
+    }
+  }
+
+  timer_cancel(&timer);
+  pass_terminal(pid, getpgrp());
+  last_status = (signal == SIGTERM) ? status_to_exit_code(child.status) : TIMEOUT_STATUS;
+}
+
+/* Bytes of slack left under ARG_MAX, same as xargs leaves by default */
+#define ARG_MAX_HEADROOM 2048
+
+/* Splits cmd's arguments, xargs-style, into the fewest execs of argv[0] that
+   each fit under ARG_MAX, and runs them at most max_jobs at a time. Since
+   arguments have to stay in order, filling each batch greedily is already
+   optimal. The batches are run from a forked coordinator so that a slow
+   batch never holds up the rest of the line.
+
+   Children that don't exec leave with _exit, so that the exit handlers and
+   stdio buffers they inherited from the shell don't run a second time. */
+static void run_batched(Command *cmd)
+{
+  let started = now_ns();
+  let pid = loop_fork();
+
+  if (pid != CHILD_PROCESS)
+  {
+    spawned(started);
+
+    if (pid != -1 && modifiers.timeout_ms) {
+      child_process_group(pid);
+    }
+
+    wait_external(pid);
+    return;
+  }
+
+  /* The batches join the coordinator's group so that a timeout covers them */
+  if (modifiers.timeout_ms)
+  {
+    own_process_group();
+    modifiers.timeout_ms = 0;
+  }
+
+  let limit = (size_t)sysconf(_SC_ARG_MAX) - ARG_MAX_HEADROOM;
+  let base = exec_args_size(cmd->argv, 1);
+  let nargs = cmd->argc;
+  char **batch = malloc((nargs + 2) * sizeof(char*));
+  Child *slots = calloc(max_jobs, sizeof(Child));
+
+  if (!batch || !slots) {
+    ppanic("malloc");
   }
-  else
+
+  for (let i = 0; i < max_jobs; i++) {
+    slots[i].done = true;
+  }
+
+  for (let next = 1; next <= nargs; )
+  {
+    let size = base;
+    let count = 0;
+
+    batch[0] = cmd->argv[0];
+
+    // Always take at least one argument, otherwise an oversized one would
+    // loop forever. execv will report it as E2BIG instead.
+    while (next <= nargs && (count == 0 || size + strlen(cmd->argv[next]) + 1 + sizeof(char*) <= limit))
+    {
+      size += strlen(cmd->argv[next]) + 1 + sizeof(char*);
+      batch[++count] = cmd->argv[next++];
+    }
+    batch[count + 1] = NULL;
+
+    Child *slot = NULL;
+
+    while (!slot)
+    {
+      for (let i = 0; i < max_jobs && !slot; i++)
+      {
+        if (slots[i].done) {
+          slot = slots + i;
+        }
+      }
+
+      if (!slot) {
+        loop_run_once();
+      }
+    }
+
+    child_watch(slot, spawn_external(batch, NULL));
+  }
+
+  let status = 0;
+
+  for (let i = 0; i < max_jobs; i++)
+  {
+    if (slots[i].pid && status_to_exit_code(child_wait(slots + i)) != 0) {
+      status = 1;
+    }
+  }
+
+  _exit(status);
+}
+
+void external_builtin(Command *cmd)
+{
+  if (batch_mode && exec_args_size(cmd->argv, cmd->argc + 1) > (size_t)sysconf(_SC_ARG_MAX) - ARG_MAX_HEADROOM) {
+    return run_batched(cmd);
+  }
+
+  PerfCounters counters;
+  let pid = spawn_external(cmd->argv, perf_mode ? &counters : NULL);
+
+  wait_external(pid);
+
+  if (perf_mode && pid != -1) {
+    perf_report(&counters, cmd->argv);
+  }
+}
+
+void toggleperf_builtin(unused Command *cmd)
+{
+  perf_mode = !perf_mode;
+
+  if (perf_mode) {
+    perf_start();
+  }
+}
+
+/* The command a prefix builtin wraps: everything after its first `skip`
+   words. Any redirect has already been applied to the prefix builtin itself. */
+static Command inner_command(Command *cmd, int skip)
+{
+  return (Command){ .argc = cmd->argc - skip, .argv = cmd->argv + skip };
+}
+
+void timeout_builtin(Command *cmd)
+{
+  let timeout_ms = cmd->argc >= 2 ? parse_duration_ms(cmd->argv[1]) : -1;
+
+  if (timeout_ms <= 0) {
+    return builtin_error("usage: timeout DURATION command [args...]");
+  }
+
+  let saved = modifiers;
+  let inner = inner_command(cmd, 2);
+
+  modifiers.timeout_ms = timeout_ms;
+  exec_single(&inner);
+  modifiers = saved;
+}
+
+void pin_builtin(Command *cmd)
+{
+  let saved = modifiers;
+
+  if (cmd->argc < 2 || !parse_cpu_list(cmd->argv[1], &modifiers.cpus)) 
+  {
+    modifiers = saved;
+    return builtin_error("usage: pin CPULIST command [args...]");
+  }
+
+  let inner = inner_command(cmd, 2);
+
+  modifiers.pinned = true;
+  exec_single(&inner);
+  modifiers = saved;
+}
+
+void prio_builtin(Command *cmd)
+{
+  char *end = NULL;
+  let nice = cmd->argc >= 2 ? strtol(cmd->argv[1], &end, 10) : 0;
+
+  if (cmd->argc < 2 || *end != '\0') {
+    return builtin_error("usage: prio NICE command [args...]");
+  }
+
+  let saved = modifiers;
+  let inner = inner_command(cmd, 2);
+
+  modifiers.reniced = true;
+  modifiers.nice = nice;
+  exec_single(&inner);
+  modifiers = saved;
+}
+
+/* ioprio CLASS[:LEVEL] command, where CLASS is rt, be or idle (or 1-3, as in
+   ioprio_set(2)) and LEVEL is 0 (highest) to 7 */
+void ioprio_builtin(Command *cmd)
+{
+  static const char *classes[] = { "none", "rt", "be", "idle" };
+  let class = -1;
+  let level = 4L;
+
+  if (cmd->argc >= 2)
+  {
+    autofree char *spec = strdup(cmd->argv[1]);
+    char *level_str = strchr(spec, ':');
+
+    if (level_str) {
+      *level_str++ = '\0';
+    }
+
+    for (let i = 1; i < 4; i++)
+    {
+      if (strcmp(spec, classes[i]) == 0 || (spec[0] == '0' + i && spec[1] == '\0')) {
+        class = i;
+      }
+    }
+
+    if (level_str) {
+      level = strtol(level_str, NULL, 10);
+    }
+  }
+
+  if (class == -1 || level < 0 || level > 7 || cmd->argc < 2) {
+    return builtin_error("usage: ioprio rt|be|idle[:LEVEL] command [args...]");
+  }
+
+  let saved = modifiers;
+  let inner = inner_command(cmd, 2);
+
+  modifiers.ioprio = IOPRIO_PRIO_VALUE(class, class == 3 ? 0 : level);
+  exec_single(&inner);
+  modifiers = saved;
+}
+
+void togglespread_builtin(unused Command *cmd)
+{
+  spread_jobs = !spread_jobs;
+}
+
+/* retry N [BACKOFF] command: reruns a failing external command up to N times
+   in total, sleeping BACKOFF (doubling each time) between attempts */
+void retry_builtin(Command *cmd)
+{
+  let attempts = cmd->argc >= 2 ? strtol(cmd->argv[1], NULL, 10) : 0;
+  let backoff_ms = cmd->argc >= 3 ? parse_duration_ms(cmd->argv[2]) : -1;
+  let skip = (backoff_ms >= 0) ? 3 : 2;
+
+  if (attempts <= 0 || cmd->argc < skip) {
+    return builtin_error("usage: retry N [BACKOFF] command [args...]");
+  }
+
+  let inner = inner_command(cmd, skip);
+
+  for (let attempt = 1; true; attempt++)
+  {
+    exec_single(&inner);
+
+    if (last_status == 0 || attempt == attempts) {
+      return;
+    }
+
+    if (backoff_ms > 0)
+    {
+      loop_sleep(backoff_ms);
+      backoff_ms *= 2;
+    }
+  }
+}
+
+/* cache [-i FILE]... [-o FILE]... command: skips rerunning an external
+   command whose arguments, executable, environment and declared input files
+   are all unchanged since it last succeeded, restoring its stdout and
+   declared output files instead (see memo.h) */
+void cache_builtin(Command *cmd)
+{
+  let nwords = cmd->argc + 1;
+  autofree char **inputs = calloc(nwords, sizeof(char*));
+  autofree char **outputs = calloc(nwords, sizeof(char*));
+  let ninputs = 0;
+  let noutputs = 0;
+  let skip = 1;
+
+  if (!inputs || !outputs) {
+    ppanic("calloc");
+  }
+
+  for (; skip + 1 < nwords; skip += 2)
+  {
+    if (strcmp(cmd->argv[skip], "-i") == 0) {
+      inputs[ninputs++] = cmd->argv[skip + 1];
+    } else if (strcmp(cmd->argv[skip], "-o") == 0) {
+      outputs[noutputs++] = cmd->argv[skip + 1];
+    } else {
+      break;
+    }
+  }
+
+  if (skip >= nwords) {
+    return builtin_error("usage: cache [-i INPUT]... [-o OUTPUT]... command [args...]");
+  }
+
+  let inner = inner_command(cmd, skip);
+
+  if (is_builtin(inner.argv[0])) {
+    return builtin_error("cache: %s is a builtin and can't be cached", inner.argv[0]);
+  }
+
+  memo_exec(&inner, inputs, outputs);
+}
+
+/* remote ADDR...: sends `&` commands to the workers at ADDR... from now on
+   (see remote.h). With no addresses, goes back to running them locally. */
+void remote_builtin(Command *cmd)
+{
+  if (!remote_set_workers(cmd->argv + 1)) {
+    return builtin_error("usage: remote [unix:PATH | tcp:HOST:PORT]...");
+  }
+}
+
+void stats_builtin(Command *cmd)
+{
+  if (cmd->argc > 1) {
+    return builtin_error("usage: stats [FILE]");
+  }
+
+  if (cmd->argc == 0)
   {
-    waitpid(pid, NULL, 0);
+    stats_print(stdout, stats);
+    return;
   }
+
+  /* Another shell's counters, from its --stats file */
+  ShellStats other;
+  autoclose int fd = open(cmd->argv[1], O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1 || read(fd, &other, sizeof other) != sizeof other
+      || memcmp(other.magic, STATS_MAGIC, sizeof STATS_MAGIC) != 0 || other.version != STATS_VERSION) {
+    return builtin_error("stats: '%s' isn't a utcsh stats file", cmd->argv[1]);
+  }
+
+  stats_print(stdout, &other);
 }
@@ -3,10 +3,26 @@
 
 #include <stdlib.h>
 
+/* How a command is joined to the one after it on its line. `&&` and `||`
+   bind tighter than `&` and `;`, so a line is a `;`-separated list of groups
+   that run one after another, each a `&`-separated list of and-or chains
+   that run concurrently. */
+typedef enum Connector {
+  CONNECT_END,   /* the last command on the line */
+  CONNECT_AND,   /* && */
+  CONNECT_OR,    /* || */
+  CONNECT_PAR,   /* & */
+  CONNECT_SEQ,   /* ; */
+} Connector;
+
 typedef struct Command {
-  int8_t argc;
+  int argc;
   char **argv;
   char *outputFile;
+  /* Any further `> file`s, NULL-terminated (NULL if there are none). The
+     output is fanned out to every one of them as well as outputFile. */
+  char **extraOutputs;
+  Connector next;
 } Command;
 
 typedef void (*CommandFnImpl)(Command *cmd);
@@ -16,15 +32,49 @@ typedef struct CommandFn {
   CommandFnImpl execute;
 } CommandFn;
 
-int set_input_source(int argc, char **argv);
+int parse_options(int argc, char **argv);
+int set_input_source(int nscripts, char **scripts);
+
+/** Runs the rest of the script with up to `--readahead` lines in flight at
+ * once. Lines that don't name any of the same files are independent, and run
+ * concurrently (up to the -j limit) with their output captured and passed on
+ * in script order; barriers (see is_barrier) run alone. Never returns. */
+void run_readahead(void);
+
+/** `-P N`: runs every script in its own forked shell, N at a time, sharing
+ * the executable cache warmed up beforehand. Each script's output is passed
+ * on in order once it finishes, followed by a line on stderr with its exit
+ * status and run time. Returns the script a forked shell should run; the
+ * coordinator exits (1 if any script failed) once they have all finished. */
+char **run_scripts(int nscripts, char **scripts);
+
+/** Resolves the commands each script starts with, up to its first `cd` or
+ * `path`, so that every shell forked afterwards already has them cached */
+void warm_exe_cache(int nscripts, char **scripts);
+
+/** Turns on `--parseahead` for the rest of the script: while a line runs, the
+ * event loop reads and parses up to that many of the lines after it, and
+ * resolves their executables, so they are ready the moment it finishes. */
+void start_parse_ahead(void);
 
 Command *read_commands(int *ncmds);
 Command *parse_commands(char *cmdline, int *ncommands);
 bool parse_command(char *segment, Command *cmd);
 
+/* Set while compiling scripts ahead of time, so that parse errors are only
+   reported when (and if) the offending line is actually reached */
+extern bool parse_quietly;
+
 int redirectStdout(const char *outputFile);
 void unredirectStdout();
 
+/** Redirects stdout into a pipe and forks a copier that fans whatever comes
+ * out of it into every one of `cmd`'s output files with tee(2) and splice(2),
+ * so the data never passes through user space. Returns the pipe's write end;
+ * once it and every other copy of it are closed, wait for `copier`. */
+struct Child;
+int fanoutStdout(Command *cmd, struct Child *copier);
+
 void eval(struct Command *cmd, int ncmds);
 void exec_single(Command *cmd);
 
@@ -35,6 +85,18 @@ void destruct(Command *cmds, int ncmds);
   X(cd)            \
   X(path)          \
   X(toggledebug)   \
+  X(togglebatch)   \
+  X(togglekeeporder) \
+  X(timeout)       \
+  X(retry)         \
+  X(pin)           \
+  X(prio)          \
+  X(ioprio)        \
+  X(togglespread)  \
+  X(toggleperf)    \
+  X(cache)         \
+  X(remote)        \
+  X(stats)         \
 
 #define X(name) void name##_builtin(Command *cmd);
   BUILTINS_X
@@ -43,4 +105,14 @@ void destruct(Command *cmds, int ncmds);
 
 extern CommandFn functions[];
 
+/* Exit status of the last command, which `$?` expands to. Shell-style for
+   external commands: 128 + signal number if it was killed, 124 if it ran out
+   of time under `timeout`. Builtins set 0, or 1 if they failed. For a line
+   with `&` jobs, it is the foreground chain's status, or if that succeeded,
+   the first failed job's. */
+extern int last_status;
+
+/* A copy of the shell's stdout, which a redirect restores once it is done */
+extern int original_stdout;
+
 #endif//UTCSH_UTCSH_R
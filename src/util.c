@@ -1,12 +1,20 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 
+#include "stats.h"
 #include "util.h"
 #include "utcsh.r"
 
@@ -19,7 +27,7 @@
   if (verbose)              \
   printf((x), ##__VA_ARGS__)
 
-extern char shell_paths[MAX_ENTRIES_IN_SHELLPATH][MAX_CHARS_PER_CMDLINE];
+char **shell_paths;
 
 /* Should the UTCSH internal functions dump verbose output? */
 static int utcsh_internal_verbose = 0;
@@ -39,19 +47,35 @@ int set_shell_path(char **newPaths)
   {
     return 0;
   }
-  int i;
-  for (i = 0; i < MAX_ENTRIES_IN_SHELLPATH; ++i)
+  size_t n = 0;
+  while (newPaths[n])
   {
-    memset(shell_paths[i], 0, MAX_CHARS_PER_CMDLINE * sizeof(char));
+    ++n;
   }
-  for (i = 0; i < MAX_ENTRIES_IN_SHELLPATH && newPaths[i]; ++i)
+  char **paths = calloc(n + 1, sizeof(char *));
+  if (!paths)
   {
-    if (strlen(newPaths[i]) + 1 > MAX_CHARS_PER_CMDLINE)
+    return 0;
+  }
+  for (size_t i = 0; i < n; ++i)
+  {
+    if (!(paths[i] = strdup(newPaths[i])))
     {
-      return 0; /* This path is too long. */
+      for (size_t j = 0; j < i; ++j)
+      {
+        free(paths[j]);
+      }
+      free(paths);
+      return 0;
     }
-    strcpy(shell_paths[i], newPaths[i]);
   }
+  for (size_t i = 0; shell_paths && shell_paths[i]; ++i)
+  {
+    free(shell_paths[i]);
+  }
+  free(shell_paths);
+  shell_paths = paths;
+  exe_cache_clear();
   return 1;
 }
 
@@ -79,109 +103,449 @@ static void joinpath(const char *dirname, const char *basename, char *buf)
   buf[dlen] = '/';
 }
 
-void tryclosedir(DIR *dirp)
+char *exe_exists_in_dir(const char *dirname, const char *filename, bool verbose)
 {
-  if (closedir(dirp) == -1 && utcsh_internal_verbose)
+  if (!dirname || !filename)
+  {
+    VERBOSE_LOG("One of the arguments to exe_exists_in_dir was NULL\n");
+    return NULL;
+  }
+  /* Only names that could be a directory entry, as when this walked the
+     directory looking for one */
+  if (!*filename || strchr(filename, '/') || STR_EQ(filename, ".") || STR_EQ(filename, ".."))
+  {
+    VERBOSE_LOG("%s can't be an entry of directory %s\n", filename, dirname);
+    return NULL;
+  }
+  size_t buflen = strlen(dirname) + strlen(filename) + 2;
+  char *buf = malloc(buflen * sizeof(char));
+  if (!buf)
   {
-    printf("[UTCSH_INTERNAL]: Error closing directory.\n");
+    VERBOSE_LOG("Failed to malloc buffer for joined pathname\n");
+    maybe_print_error();
+    return NULL;
+  }
+  joinpath(dirname, filename, buf);
+
+  /* One probe for the entry instead of reading the whole directory, which
+     is what makes big or network-mounted bin directories slow */
+  int exec_forbidden = faccessat(AT_FDCWD, buf, X_OK, 0);
+  if (!exec_forbidden)
+  {
+    VERBOSE_LOG("Found executable file %s\n", buf);
+    return buf;
+  }
+  switch (errno)
+  {
+  case EACCES:
+  case ENOENT:
+  case ENOTDIR:
+    break; /* These are benign faults */
+  case EIO:
+  case EINVAL:
+  case EFAULT:
+  case ENOMEM:
+  case ETXTBSY:
+  case EROFS:
+  case ENAMETOOLONG:
+  case ELOOP:
+    maybe_print_error(); /* User might want to know about these */
   }
+  errno = 0;
+  free(buf);
+  VERBOSE_LOG("Did not find file %s in directory %s\n", filename, dirname);
+  return NULL;
 }
 
-char *exe_exists_in_dir(const char *dirname, const char *filename, bool verbose)
+/* Executables resolved ahead of time (see exe_cache_add), by name. Entries
+   live in an array in the order they were added, found through an
+   open-addressed table of indices into it (plus one, so that 0 is empty)
+   that is kept at most half full. */
+typedef struct ExeCacheEntry {
+  char *name;
+  char *path;
+} ExeCacheEntry;
+
+static ExeCacheEntry *exe_cache;
+static size_t exe_cache_len;
+static size_t exe_cache_cap;
+static uint32_t *exe_cache_slots;
+static size_t exe_cache_nslots;
+
+#define GETDENTS_BUF_SIZE (256 << 10)
+#define INDEX_MAX_THREADS 16
+
+/* Largest entry exe_cache_send sends: a name and a path */
+#define EXE_CACHE_MSG_MAX 4096
+
+/* The slot `name` is in, or the empty one it would go in */
+static uint32_t *exe_cache_slot(const char *name)
 {
-  if (!dirname || !filename)
+  let mask = exe_cache_nslots - 1;
+
+  for (let i = content_hash(name, strlen(name)) & mask; true; i = (i + 1) & mask)
   {
-    VERBOSE_LOG("One of the arguments to exe_exists_in_dir was NULL\n");
-    return NULL;
+    let slot = exe_cache_slots + i;
+
+    if (!*slot || strcmp(exe_cache[*slot - 1].name, name) == 0) {
+      return slot;
+    }
+  }
+}
+
+static void exe_cache_rehash(size_t nslots)
+{
+  free(exe_cache_slots);
+  exe_cache_slots = calloc(nslots, sizeof(uint32_t));
+  exe_cache_nslots = nslots;
+
+  if (!exe_cache_slots) {
+    ppanic("calloc");
   }
-  DIR *dir;
-  struct dirent *dent;
-  dir = opendir(dirname);
-  if (!dir)
+
+  for (size_t i = 0; i < exe_cache_len; i++)
   {
-    VERBOSE_LOG("Could not open directory %s\n", dirname);
+    *exe_cache_slot(exe_cache[i].name) = i + 1;
+  }
+}
+
+static ExeCacheEntry *exe_cache_find(const char *name)
+{
+  if (!exe_cache_len) {
     return NULL;
   }
 
-  errno = 0; /* To distinguish EOS from error, see man 3 readdir */
-  while ((dent = readdir(dir)))
+  let slot = exe_cache_slot(name);
+  return *slot ? exe_cache + *slot - 1 : NULL;
+}
+
+/* Takes ownership of `name` and `path` */
+static void exe_cache_insert(char *name, char *path)
+{
+  if (exe_cache_len == exe_cache_cap)
   {
-    if (STR_EQ(dent->d_name, filename))
+    exe_cache_cap = exe_cache_cap ? exe_cache_cap * 2 : 16;
+    exe_cache = realloc(exe_cache, exe_cache_cap * sizeof(ExeCacheEntry));
+
+    if (!exe_cache) {
+      ppanic("realloc");
+    }
+  }
+
+  exe_cache[exe_cache_len++] = (ExeCacheEntry){ name, path };
+
+  if (exe_cache_len * 2 > exe_cache_nslots) {
+    exe_cache_rehash(exe_cache_nslots ? exe_cache_nslots * 2 : 32);
+  } else {
+    *exe_cache_slot(name) = exe_cache_len;
+  }
+}
+
+void exe_cache_add(char *name)
+{
+  if (exe_cache_find(name)) {
+    return;
+  }
+
+  char *path = find_exe(name);
+
+  if (path) {
+    exe_cache_insert(strdup(name), path);
+  }
+}
+
+/* The names in one directory, NUL-separated */
+typedef struct DirListing {
+  const char *dir;
+  char *names;
+  size_t len;
+} DirListing;
+
+/* The record getdents64 fills its buffer with, which glibc doesn't export */
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/* Reads a whole directory with as few getdents64 calls as a large buffer
+   allows, rather than readdir's one small batch at a time */
+static void list_dir(DirListing *listing, char *buf)
+{
+  let fd = open(listing->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  FILE *out = open_memstream(&listing->names, &listing->len);
+  long n = 0;
+
+  if (!out) {
+    ppanic("open_memstream");
+  }
+
+  while (fd != -1 && (n = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF_SIZE)) > 0)
+  {
+    for (long off = 0; off < n; )
     {
-      size_t buflen = strlen(dirname) + strlen(filename) + 2;
-      char *buf = malloc(buflen * sizeof(char));
-      if (!buf)
-      {
-        VERBOSE_LOG("Failed to malloc buffer for joined pathname\n");
-        maybe_print_error();
-        return NULL;
+      struct linux_dirent64 *dent = (void *)(buf + off);
+      off += dent->d_reclen;
+
+      if (!STR_EQ(dent->d_name, ".") && !STR_EQ(dent->d_name, "..")) {
+        fwrite(dent->d_name, 1, strlen(dent->d_name) + 1, out);
       }
-      joinpath(dirname, filename, buf);
-      int exec_forbidden = access(buf, X_OK);
-      if (!exec_forbidden)
-      {
-        tryclosedir(dir);
-        VERBOSE_LOG("Found executable file %s\n", buf);
-        return buf;
+    }
+  }
+
+  fclose(out);
+
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+typedef struct IndexWork {
+  DirListing *listings;
+  size_t n;
+  size_t next;
+} IndexWork;
+
+static void *index_worker(void *data)
+{
+  IndexWork *work = data;
+  char *buf = malloc(GETDENTS_BUF_SIZE);
+
+  if (!buf) {
+    ppanic("malloc");
+  }
+
+  for (size_t i; (i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->n; ) {
+    list_dir(work->listings + i, buf);
+  }
+
+  free(buf);
+  return NULL;
+}
+
+void exe_cache_index(void)
+{
+  size_t ndirs = 0;
+
+  while (shell_paths && shell_paths[ndirs]) {
+    ndirs++;
+  }
+
+  autofree DirListing *listings = calloc(ndirs + 1, sizeof(DirListing));
+  IndexWork work = { listings, 0, 0 };
+
+  if (!listings) {
+    ppanic("calloc");
+  }
+
+  /* Relative entries depend on the cwd, so they are left to find_exe, which
+     probes the ones ahead of a cached directory before trusting it */
+  for (size_t i = 0; i < ndirs; i++)
+  {
+    if (is_absolute_path(shell_paths[i])) {
+      listings[work.n++].dir = shell_paths[i];
+    }
+  }
+
+  /* Every directory is read at once, so that slow ones (network mounts, say)
+     overlap rather than add up */
+  let nthreads = work.n < INDEX_MAX_THREADS ? work.n : INDEX_MAX_THREADS;
+  pthread_t threads[INDEX_MAX_THREADS];
+  size_t started = 0;
+
+  while (started + 1 < nthreads && pthread_create(threads + started, NULL, index_worker, &work) == 0) {
+    started++;
+  }
+
+  index_worker(&work);
+
+  for (size_t i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  /* Merged in path order, so that the first directory to have a name is the
+     one it resolves to, as in find_exe. Entries that aren't executable are
+     still added; find_exe checks before trusting one, and searches past it. */
+  for (size_t i = 0; i < work.n; i++)
+  {
+    let listing = listings + i;
+
+    for (let name = listing->names; name && name < listing->names + listing->len; name += strlen(name) + 1)
+    {
+      if (exe_cache_find(name)) {
+        continue;
       }
-      else
-      {
-        VERBOSE_LOG("Found file %s but it doesn't look executable\n", buf);
-        switch (errno)
-        {
-        case EACCES:
-        case ENOENT:
-        case ENOTDIR:
-          errno = 0;
-          break; /* These are benign faults */
-        case EIO:
-        case EINVAL:
-        case EFAULT:
-        case ENOMEM:
-        case ETXTBSY:
-        case EROFS:
-        case ENAMETOOLONG:
-        case ELOOP:
-          maybe_print_error(); /* User might want to know about these */
-          errno = 0;
-        }
-        free(buf);
+
+      char *path = malloc(strlen(listing->dir) + strlen(name) + 2);
+
+      if (!path) {
+        ppanic("malloc");
       }
+
+      joinpath(listing->dir, name, path);
+      exe_cache_insert(strdup(name), path);
     }
-    else
-    {
-      VERBOSE_LOG("File %s does not match requested filename of %s\n", dent->d_name, filename);
+
+    free(listing->names);
+  }
+}
+
+/* Whether `path` is `name` in the path directory `dir` */
+static bool exe_in_path_dir(const char *path, const char *dir, const char *name)
+{
+  let len = strlen(dir);
+  return strncmp(path, dir, len) == 0 && path[len] == '/' && strcmp(path + len + 1, name) == 0;
+}
+
+/* Whether `path` is `name` in one of the absolute directories on the path
+   that come before any relative one. Which file a name resolves to past a
+   relative entry depends on the cwd. */
+static bool exe_cache_on_path(const char *path, const char *name)
+{
+  for (let dir = shell_paths; dir && *dir && is_absolute_path(*dir); dir++)
+  {
+    if (exe_in_path_dir(path, *dir, name)) {
+      return true;
     }
   }
-  /* We have exited the loop. Why? If errno is nonzero, it's an error. */
-  if (errno == EBADF)
+
+  return false;
+}
+
+/* Looks for `name` in the relative path entries ahead of the directory the
+   cache found it in, which can gain a file of that name at any time */
+static char *exe_cache_shadow(const ExeCacheEntry *entry)
+{
+  for (let dir = shell_paths; dir && *dir && !exe_in_path_dir(entry->path, *dir, entry->name); dir++)
   {
-    maybe_print_error();
+    char *path;
+
+    if (!is_absolute_path(*dir) && (path = exe_exists_in_dir(*dir, entry->name, false))) {
+      return path;
+    }
   }
-  tryclosedir(dir);
-  VERBOSE_LOG("Did not find file %s in directory %s\n", filename, dirname);
+
   return NULL;
 }
 
+void exe_cache_chdir(void)
+{
+  size_t kept = 0;
+
+  for (size_t i = 0; i < exe_cache_len; i++)
+  {
+    let entry = exe_cache[i];
+
+    if (exe_cache_on_path(entry.path, entry.name))
+    {
+      exe_cache[kept++] = entry;
+      continue;
+    }
+
+    free(entry.name);
+    free(entry.path);
+  }
+
+  exe_cache_len = kept;
+  exe_cache_rehash(exe_cache_nslots);
+}
+
+size_t exe_cache_size(void)
+{
+  return exe_cache_len;
+}
+
+void exe_cache_send(int fd, size_t from)
+{
+  for (size_t i = from; i < exe_cache_len; i++)
+  {
+    let entry = exe_cache[i];
+    let name_len = strlen(entry.name) + 1;
+    let path_len = strlen(entry.path) + 1;
+    char buf[EXE_CACHE_MSG_MAX];
+
+    if (name_len + path_len > sizeof buf) {
+      continue;
+    }
+
+    memcpy(buf, entry.name, name_len);
+    memcpy(buf + name_len, entry.path, path_len);
+    send(fd, buf, name_len + path_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  }
+}
+
+void exe_cache_receive(int fd)
+{
+  char buf[EXE_CACHE_MSG_MAX];
+  ssize_t n;
+
+  while ((n = recv(fd, buf, sizeof buf, MSG_DONTWAIT)) > 0)
+  {
+    /* A name and a path, each NUL-terminated */
+    let split = memchr(buf, '\0', n);
+
+    if (!split || split == buf + n - 1 || buf[n - 1] != '\0' || exe_cache_find(buf)
+        || !exe_cache_on_path(split + 1, buf)) {
+      continue;
+    }
+
+    exe_cache_insert(strdup(buf), strdup(split + 1));
+  }
+}
+
+void exe_cache_clear(void)
+{
+  for (size_t i = 0; i < exe_cache_len; i++)
+  {
+    free(exe_cache[i].name);
+    free(exe_cache[i].path);
+  }
+
+  exe_cache_len = 0;
+
+  if (exe_cache_slots) {
+    memset(exe_cache_slots, 0, exe_cache_nslots * sizeof(uint32_t));
+  }
+}
+
 char* find_exe(char* name)
 {
   char *full_path;
-  char cwd[256];
+  autofree char *cwd = getcwd(NULL, 0);
 
-  if (getcwd(cwd, sizeof cwd) == NULL) {
+  if (cwd == NULL) {
     scold_user("cwd");
     return NULL;
   }
 
+  /* The cwd shadows the path, and can gain a file of the name at any time
+     (a line run after the cache was filled may have just built it), so it is
+     always probed before a cached answer is trusted */
   if ((full_path = exe_exists_in_dir(cwd, name, false))) {
     return full_path;
   }
 
-  for (let i = 0; i < MAX_ENTRIES_IN_SHELLPATH; i++)
+  let cached = exe_cache_find(name);
+
+  if (cached && (full_path = exe_cache_shadow(cached))) {
+    return full_path;
+  }
+
+  /* One access() instead of a whole search, unless it has gone away since */
+  if (cached && access(cached->path, X_OK) == 0)
   {
-    let path = shell_paths[i];
+    stats_add(exe_cache_hits, 1);
+    return strdup(cached->path);
+  }
+
+  stats_add(exe_cache_misses, 1);
 
-    if ((full_path = exe_exists_in_dir(path, name, false))) {
+  for (let path = shell_paths; path && *path; path++)
+  {
+    if ((full_path = exe_exists_in_dir(*path, name, false))) {
       return full_path;
     }
   }
@@ -189,6 +553,122 @@ char* find_exe(char* name)
   return NULL;
 }
 
+size_t exec_args_size(char **argv, int argc)
+{
+  extern char **environ;
+  size_t size = 0;
+
+  for (let i = 0; i < argc; i++)
+  {
+    size += strlen(argv[i]) + 1 + sizeof(char *);
+  }
+
+  for (let env = environ; *env; env++)
+  {
+    size += strlen(*env) + 1 + sizeof(char *);
+  }
+
+  return size + 2 * sizeof(char *);
+}
+
+long parse_duration_ms(const char *str)
+{
+  char *unit;
+  double value = strtod(str, &unit);
+
+  if (unit == str || value < 0) {
+    return -1;
+  }
+
+  if (STR_EQ(unit, "ms")) {
+    return value;
+  }
+  if (STR_EQ(unit, "") || STR_EQ(unit, "s")) {
+    return value * 1000;
+  }
+  if (STR_EQ(unit, "m")) {
+    return value * 60 * 1000;
+  }
+  if (STR_EQ(unit, "h")) {
+    return value * 60 * 60 * 1000;
+  }
+  return -1;
+}
+
+bool parse_cpu_list(const char *str, cpu_set_t *set)
+{
+  CPU_ZERO(set);
+
+  while (*str)
+  {
+    char *end;
+    long first = strtol(str, &end, 10);
+    long last = first;
+
+    if (end == str || first < 0) {
+      return false;
+    }
+
+    if (*end == '-')
+    {
+      str = end + 1;
+      last = strtol(str, &end, 10);
+
+      if (end == str || last < first) {
+        return false;
+      }
+    }
+
+    if (last >= CPU_SETSIZE) {
+      return false;
+    }
+
+    for (long cpu = first; cpu <= last; cpu++)
+    {
+      CPU_SET(cpu, set);
+    }
+
+    if (*end == ',') {
+      end++;
+    } else if (*end != '\0') {
+      return false;
+    }
+    str = end;
+  }
+
+  return CPU_COUNT(set) > 0;
+}
+
+bool copy_fd(int from, int to)
+{
+  off_t off = 0;
+  ssize_t n;
+
+  while ((n = sendfile(to, from, &off, 1 << 20)) > 0)
+    ;
+
+  if (n == 0) {
+    return true;
+  }
+
+  /* sendfile refuses some targets (e.g. files opened with O_APPEND), so fall
+     back to copying through userspace from wherever it stopped */
+  char buf[8192];
+
+  while ((n = pread(from, buf, sizeof buf, off)) > 0)
+  {
+    for (ssize_t done = 0, w; done < n; done += w)
+    {
+      if ((w = write(to, buf + done, n - done)) == -1) {
+        return false;
+      }
+    }
+    off += n;
+  }
+
+  return n == 0;
+}
+
 int num_whitespaces(const char *str)
 {
   int count = 0;
@@ -247,3 +727,28 @@ void close_fd(int *fd)
     close(*fd);
   }
 }
+
+uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t content_hash_update(uint64_t hash, const void *data, size_t len)
+{
+  const unsigned char *bytes = data;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+uint64_t content_hash(const void *data, size_t len)
+{
+  return content_hash_update(0xcbf29ce484222325ULL, data, len);
+}
@@ -1,22 +1,22 @@
 #ifndef UTCSH_UTILS_H
 #define UTCSH_UTILS_H
 
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include "io.h"
 #include "utcsh.r"
 
-#define MAX_CHARS_PER_CMDLINE 2048
-#define MAX_WORDS_PER_CMDLINE 256
-#define MAX_CHARS_PER_CMD 512
-#define MAX_WORDS_PER_CMD 64
-#define MAX_ENTRIES_IN_SHELLPATH 256
-
 /**
- * Modify the shell_paths global. Will run until all MAX_ENTRIES_IN_SHELLPATH
- * elements have been set or a NULL char* is found in newPaths. Returns 1 on
- * success and zero on error *
+ * Modify the shell_paths global, replacing it with a copy of the
+ * NULL-terminated newPaths. There is no limit on the number or length of the
+ * entries. Returns 1 on success and zero on error *
  */
 int set_shell_path(char **newPaths);
 
+/** The NULL-terminated list of directories searched by find_exe */
+extern char **shell_paths;
+
 /** Returns 1 if this is an absolute path, 0 otherwise */
 int is_absolute_path(char *path);
 
@@ -58,4 +58,64 @@ extern bool in_debug_mode;
 void printcmds(Command *cmds, int ncmds);
 char* find_exe(char* name);
 
+/** Resolves `name` now and remembers the result, so that a later find_exe
+ * (usually in a freshly forked child) doesn't have to search the path for
+ * it. find_exe still probes the cwd, and any relative path entries ahead of
+ * the cached one, first, since anything that appears there shadows the
+ * cache. Only found executables are remembered. The cache is
+ * cleared by set_shell_path and must be cleared by anything else that
+ * changes what find_exe would return, except changing directory, which
+ * exe_cache_chdir handles. */
+void exe_cache_add(char *name);
+void exe_cache_clear(void);
+
+/** Adds everything in the absolute directories on the path to the cache, as
+ * find_exe would resolve it, for shells that will go on to run many
+ * commands. The directories are read in parallel. */
+void exe_cache_index(void);
+
+/** Drops the cached executables that changing directory could change the
+ * answer for: ones found in the old cwd, in a relative path entry, or in a
+ * directory that comes after a relative path entry. Whatever the new cwd
+ * shadows is left to find_exe's own probe of it. */
+void exe_cache_chdir(void);
+
+/** Number of entries in the cache, to pass to exe_cache_send later. */
+size_t exe_cache_size(void);
+
+/** Sends the entries added since the cache held `from` of them to `fd`, a
+ * datagram socket, one entry per message, without blocking. For sharing what
+ * a forked process resolved with the process it was forked from. */
+void exe_cache_send(int fd, size_t from);
+
+/** Adds the entries exe_cache_send sent to the other end of `fd` and that
+ * are waiting there, skipping ones it already has and ones not found in an
+ * absolute directory on the path ahead of any relative one. Never blocks. */
+void exe_cache_receive(int fd);
+
+/** Number of bytes `argv` (plus the current environment) takes up in a new
+ * process image, counted the same way the kernel counts against ARG_MAX. */
+size_t exec_args_size(char **argv, int argc);
+
+/** Parses a duration such as `5`, `1.5s`, `250ms`, `2m` or `1h` (bare numbers
+ * are seconds) into milliseconds. Returns -1 if it isn't a duration. */
+long parse_duration_ms(const char *str);
+
+/** Parses a CPU list such as `0-3,6` into `set`. Returns false if malformed. */
+bool parse_cpu_list(const char *str, cpu_set_t *set);
+
+/** Copies everything in the file `from` (starting at offset zero) to `to`,
+ * in-kernel via sendfile where possible. Returns false if the copy failed. */
+bool copy_fd(int from, int to);
+
+/** 64-bit FNV-1a over `len` bytes of `data`. */
+uint64_t content_hash(const void *data, size_t len);
+
+/** Continues a content_hash with `len` more bytes, so that several pieces can
+ * be hashed as if they were one buffer */
+uint64_t content_hash_update(uint64_t hash, const void *data, size_t len);
+
+/** Monotonic clock reading in nanoseconds */
+uint64_t now_ns(void);
+
 #endif//UTILS
@@ -0,0 +1,347 @@
+#!/usr/bin/env python3
+
+## Sweeps utcsh through every fault EvilBoomBox can inject, in parallel.
+#
+# tests/test-utils/run-evil-boom-box.sh fails one call at a time, counting all
+# hooked functions together and picking the errno at random, and stops at the
+# first problem. This instead tries every point of
+#
+#   (function, failure mode, countdown)
+#
+# for each function and errno listed in p2a-ebb/other.c (EBB_SYSCALL_FUNC,
+# EBB_SYSCALL_MODE, EBB_SYSCALL_CTR), plus every allocation countdown
+# (EBB_ALLOC_CTR). A series stops at the first countdown whose failure never
+# fires. Runs go --jobs at a time, each in its own directory, so each has its
+# own .ebb_files and its own copy of the script's output files; later
+# countdowns of a series are started speculatively and thrown away if an
+# earlier one turns out to be the end.
+#
+# Every run is classified as one of
+#
+#   crash   utcsh, or a process it forked, died from a signal
+#   hang    utcsh didn't exit within --timeout
+#   leak    a process utcsh forked outlived it, or utcsh exited with more
+#           heap live than any clean run (EBB_ALLOC_PROFILE)
+#   ok      anything else: exiting with an error is a fine response to a fault
+#
+# and runs with the same outcome (class, exit status and stderr, see
+# Outcome.signature) are reported once, with the count and the parameters of
+# the earliest run that reproduces it.
+
+import argparse
+import concurrent.futures
+import errno
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+TOP = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+UTILDIR = os.path.join(TOP, "tests", "test-utils")
+EBB_DIR = os.path.join(UTILDIR, "p2a-ebb")
+EBB_LIB = os.path.join(EBB_DIR, "libevilboombox.so")
+DEFAULT_SKEL = os.path.join(TOP, "tests", "test-specs", "evilboombox", "skel")
+
+# Shared with other.c and alloc.c
+EBB_OUT_DIR = ".ebb_files"
+FIRED = {"syscall": ".ebb_syscall_fired", "alloc": ".ebb_alloc_fired"}
+PROFILE = "profile"
+
+# Time for forked children to finish exiting after utcsh has, before any
+# still running count as leaked
+GRACE_S = 1.0
+
+
+def failure_modes():
+    """{function: [errno names]}, read from the tables in other.c, in order"""
+    with open(os.path.join(EBB_DIR, "other.c")) as f:
+        source = f.read()
+    modes = {}
+    for func, errnos in re.findall(r"int (\w+)Failures\[\] = \{([^}]*)\}", source):
+        modes[func.lower()] = [e.strip() for e in errnos.split(",") if e.strip()]
+    return modes
+
+
+class Point:
+    """One fault to inject: a countdown of one series"""
+
+    def __init__(self, kind, func, mode, countdown):
+        self.kind = kind
+        self.func = func
+        self.mode = mode
+        self.countdown = countdown
+
+    @property
+    def series(self):
+        return (self.kind, self.func, self.mode)
+
+    def env(self):
+        if self.kind == "alloc":
+            return {"EBB_ALLOC_CTR": str(self.countdown)}
+        return {"EBB_SYSCALL_FUNC": self.func, "EBB_SYSCALL_MODE": self.mode,
+                "EBB_SYSCALL_CTR": str(self.countdown)}
+
+    def __str__(self):
+        if self.kind == "alloc":
+            return f"alloc countdown {self.countdown}"
+        return f"{self.func} {self.mode} countdown {self.countdown}"
+
+
+class Outcome:
+    def __init__(self, point, verdict, detail, stderr, fired, live):
+        self.point = point
+        self.verdict = verdict
+        self.detail = detail
+        self.stderr = stderr
+        self.fired = fired
+        self.live = live
+
+    @property
+    def signature(self):
+        """What makes two outcomes the same: the same verdict and the same
+        distinct stderr lines, once the injected errno's message is masked
+        so that e.g. EACCES and EPERM don't count as different outcomes"""
+        mode = self.point.mode if self.point and self.point.kind == "syscall" else "ENOMEM"
+        message = os.strerror(getattr(errno, mode))
+        lines = {line.replace(message, "<errno>") for line in self.stderr.splitlines()}
+        return (self.verdict, self.detail, tuple(sorted(lines)))
+
+
+def make_script(skel, rundir):
+    """The test script with its variables filled in for one run directory"""
+    with open(skel) as f:
+        text = f.read()
+    text = text.replace("$TMPDIR", rundir)
+    text = text.replace("$SRCDIR", os.path.dirname(os.path.abspath(skel)))
+    text = text.replace("$UTILDIR", UTILDIR)
+    text = text.replace("$TESTID", "")
+    path = os.path.join(rundir, "in")
+    with open(path, "w") as f:
+        f.write(text)
+    return path
+
+
+def live_at_exit(rundir):
+    try:
+        with open(os.path.join(rundir, PROFILE)) as f:
+            match = re.search(r"live at exit (\d+)", f.read())
+    except FileNotFoundError:
+        return None
+    return int(match.group(1)) if match else None
+
+
+def leftover_pids(rundir):
+    """PIDs of processes that started under EBB and never exited cleanly"""
+    outdir = os.path.join(rundir, EBB_OUT_DIR)
+    try:
+        return [int(n) for n in os.listdir(outdir) if n.isdigit()]
+    except FileNotFoundError:
+        return []
+
+
+def alive(pid):
+    try:
+        with open(f"/proc/{pid}/stat") as f:
+            return f.read().rsplit(")", 1)[1].split()[0] != "Z"
+    except (FileNotFoundError, IndexError):
+        return False
+
+
+def run_point(point, args, workdir, serial, baseline_live):
+    rundir = os.path.join(workdir, f"run{serial}")
+    os.makedirs(rundir)
+    script = make_script(args.script, rundir)
+
+    env = dict(os.environ)
+    env.update(point.env() if point else {})
+    env["LD_PRELOAD"] = EBB_LIB
+    env["EBB_ALLOC_PROFILE"] = os.path.join(rundir, PROFILE)
+    # utcsh's children that never exec leave with _exit() on purpose
+    env["EBB_EXIT_IS_CLEAN"] = "1"
+
+    proc = subprocess.Popen([args.utcsh, script], cwd=rundir, env=env,
+                            stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE, start_new_session=True)
+    try:
+        _, err = proc.communicate(timeout=args.timeout)
+        hung = False
+    except subprocess.TimeoutExpired:
+        os.killpg(proc.pid, signal.SIGKILL)
+        _, err = proc.communicate()
+        hung = True
+
+    stderr = err.decode(errors="replace").replace(rundir, "<run>")
+    fired = point is None or os.path.exists(os.path.join(rundir, EBB_OUT_DIR, FIRED[point.kind]))
+
+    deadline = time.monotonic() + GRACE_S
+    pids = leftover_pids(rundir)
+    while pids and any(alive(p) for p in pids) and time.monotonic() < deadline:
+        time.sleep(0.05)
+        pids = leftover_pids(rundir)
+    running = [p for p in pids if alive(p)]
+    try:
+        os.killpg(proc.pid, signal.SIGKILL)
+    except ProcessLookupError:
+        pass
+
+    live = live_at_exit(rundir)
+    if hung:
+        verdict, detail = "hang", f"no exit after {args.timeout}s"
+    elif proc.returncode < 0:
+        verdict, detail = "crash", f"utcsh got {signal.Signals(-proc.returncode).name}"
+    elif len(pids) > len(running):
+        verdict, detail = "crash", "a forked process died without exiting"
+    elif running:
+        verdict, detail = "leak", "a forked process outlived utcsh"
+    elif live is not None and baseline_live is not None and live > baseline_live:
+        verdict, detail = "leak", f"heap live at exit above the clean {baseline_live} bytes"
+    else:
+        verdict, detail = "ok", f"exit {proc.returncode}"
+
+    if not args.keep:
+        shutil.rmtree(rundir, ignore_errors=True)
+    return Outcome(point, verdict, detail, stderr, fired, live)
+
+
+def sweep(series, args, workdir, baseline_live):
+    """Runs every series until its failures stop firing. Returns the outcomes
+    of every run that fired, in no particular order."""
+    next_countdown = {s: 0 for s in series}
+    end = {s: args.max_countdown for s in series}
+    outcomes = []
+    serial = 0
+    started = time.monotonic()
+
+    def next_point():
+        for s in series:
+            if next_countdown[s] < end[s]:
+                point = Point(*s, next_countdown[s])
+                next_countdown[s] += 1
+                return point
+        return None
+
+    with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+        running = {}
+        while True:
+            while len(running) < args.jobs * 2:
+                point = next_point()
+                if point is None:
+                    break
+                serial += 1
+                running[pool.submit(run_point, point, args, workdir, serial, baseline_live)] = point
+            if not running:
+                break
+
+            done, _ = concurrent.futures.wait(running, return_when=concurrent.futures.FIRST_COMPLETED)
+            for future in done:
+                point = running.pop(future)
+                outcome = future.result()
+                if point.countdown >= end[point.series]:
+                    continue
+                if not outcome.fired:
+                    end[point.series] = point.countdown
+                    continue
+                outcomes.append(outcome)
+
+            if args.progress:
+                print(f"\r{len(outcomes)} runs, {time.monotonic() - started:.0f}s",
+                      end="", file=sys.stderr)
+
+    if args.progress:
+        print(file=sys.stderr)
+    # Anything past a series' end was started speculatively, and may have
+    # finished before the run that ended it
+    return [o for o in outcomes if o.point.countdown < end[o.point.series]], end
+
+
+def runs(n):
+    return f"{n} run" if n == 1 else f"{n} runs"
+
+
+def report(outcomes, end, args, baseline_live, wall):
+    groups = {}
+    for outcome in sorted(outcomes, key=lambda o: (o.point.series, o.point.countdown)):
+        groups.setdefault(outcome.signature, []).append(outcome)
+
+    problems = [g for g in groups.values() if g[0].verdict != "ok"]
+    capped = [s for s, e in end.items() if e == args.max_countdown]
+
+    print(f"{runs(len(outcomes))} over {len(end)} series in {wall:.1f}s, "
+          f"{len(groups)} distinct outcomes, {len(problems)} of them problems")
+    print(f"clean run: heap live at exit {baseline_live} bytes")
+    for s in capped:
+        print(f"note: {' '.join(filter(None, s))} still firing at --max-countdown {args.max_countdown}")
+
+    for group in sorted(problems, key=lambda g: ("crash", "hang", "leak").index(g[0].verdict)):
+        first = group[0]
+        print(f"\n{first.verdict.upper()}: {first.detail} ({runs(len(group))})")
+        print(f"  first: {first.point}")
+        env = " ".join(f"{k}={v}" for k, v in first.point.env().items())
+        print(f"  repro: {env} LD_PRELOAD={EBB_LIB} {args.utcsh} <script>")
+        for line in first.stderr.splitlines()[:5]:
+            print(f"  stderr: {line}")
+
+    if args.all:
+        for group in groups.values():
+            if group[0].verdict == "ok":
+                print(f"\nok: {group[0].detail} ({runs(len(group))}), first: {group[0].point}")
+                for line in group[0].stderr.splitlines()[:3]:
+                    print(f"  stderr: {line}")
+
+    return 1 if problems else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Parallel EvilBoomBox fault sweep")
+    parser.add_argument("--utcsh", default=os.path.join(TOP, "utcsh"))
+    parser.add_argument("--script", default=DEFAULT_SKEL,
+                        help="test skel to run ($TMPDIR etc. are filled in per run)")
+    parser.add_argument("--jobs", "-j", type=int, default=os.cpu_count() or 1)
+    parser.add_argument("--timeout", type=float, default=10, help="seconds before a run counts as hung")
+    parser.add_argument("--max-countdown", type=int, default=2000)
+    parser.add_argument("--funcs", help="comma-separated functions to sweep (default: all, and alloc)")
+    parser.add_argument("--keep", action="store_true", help="keep every run's directory")
+    parser.add_argument("--all", action="store_true", help="list the ok outcomes too")
+    parser.add_argument("--progress", action="store_true")
+    args = parser.parse_args()
+    args.utcsh = os.path.abspath(args.utcsh)
+    args.script = os.path.abspath(args.script)
+
+    if subprocess.run(["make", "-C", EBB_DIR], stdout=subprocess.DEVNULL).returncode != 0:
+        sys.exit("ebb-sweep: couldn't build libevilboombox.so")
+
+    modes = failure_modes()
+    wanted = args.funcs.split(",") if args.funcs else list(modes) + ["alloc"]
+    series = []
+    for func in wanted:
+        if func == "alloc":
+            series.append(("alloc", None, None))
+        elif func in modes:
+            series.extend(("syscall", func, mode) for mode in modes[func])
+        else:
+            sys.exit(f"ebb-sweep: unknown function {func} (known: {', '.join(modes)}, alloc)")
+
+    workdir = tempfile.mkdtemp(prefix="ebb-sweep-")
+    try:
+        clean = [run_point(None, args, workdir, f"clean{i}", None) for i in range(3)]
+        if any(c.verdict != "ok" for c in clean):
+            sys.exit(f"ebb-sweep: utcsh isn't clean without faults: {clean[0].detail}")
+        baseline_live = max((c.live for c in clean if c.live is not None), default=None)
+
+        started = time.monotonic()
+        outcomes, end = sweep(series, args, workdir, baseline_live)
+        status = report(outcomes, end, args, baseline_live, time.monotonic() - started)
+    finally:
+        if args.keep:
+            print(f"\nrun directories kept in {workdir}")
+        else:
+            shutil.rmtree(workdir, ignore_errors=True)
+    sys.exit(status)
+
+
+if __name__ == "__main__":
+    main()
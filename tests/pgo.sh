@@ -0,0 +1,141 @@
+#!/bin/bash
+
+## The workload and the measurements behind `make pgo`.
+#
+#   tests/pgo.sh train            Runs ./utcsh (the instrumented build) over
+#                                 every test spec, stress specs included, so
+#                                 that its profile reflects real use
+#   tests/pgo.sh compare A B      Times startup and per-command overhead of
+#                                 shell A against shell B
+#
+# Training doesn't check any output: it only has to exercise the shell. The
+# specs are copied to a scratch directory and filled in there, so the `in`
+# files in the tree are left alone. Specs that run under EvilBoomBox are
+# skipped, since failing the instrumented shell's own profile writes could
+# leave a corrupt profile behind, and failure paths aren't what we optimise
+# for anyway.
+
+specdir="tests/test-specs"
+utildir="tests/test-utils"
+
+function fill_in(){
+    # $1: file, $2: spec's scratch copy, $3: test id, $4: scratch TMPDIR
+    sed -e "s#\$TMPDIR#$4#g" -e "s#\$SRCDIR#$2#g" \
+        -e "s#\$TESTID#$3#g" -e "s#\$UTILDIR#$utildir#g" "$1"
+}
+
+function train(){
+    if [ ! -x ./utcsh ]; then
+        echo "pgo.sh: no ./utcsh to train" >&2
+        exit 1
+    fi
+
+    local scratch
+    scratch="$(mktemp -d)"
+    trap 'rm -rf "$scratch"' EXIT
+    mkdir -p "$scratch/tmp"
+
+    local id name spec
+    while read -r id name || [ -n "$id" ]; do
+        [ -n "$name" ] || continue
+        if grep -qs -e "p2a-ebb" -e "evil-boom-box" "$specdir/$name"/{run,check}; then
+            continue
+        fi
+
+        spec="$scratch/$name"
+        cp -r "$specdir/$name" "$spec"
+        fill_in "$spec/skel" "$spec" "$id" "$scratch/tmp" > "$spec/in"
+
+        [ -f "$spec/pre" ] && bash <(fill_in "$spec/pre" "$spec" "$id" "$scratch/tmp") &> /dev/null
+        # Braced so that bash's own "Segmentation fault" notices go quiet too
+        { timeout 30 bash -c "$(fill_in "$spec/run" "$spec" "$id" "$scratch/tmp")" < /dev/null &> /dev/null; } 2> /dev/null
+        [ -f "$spec/post" ] && bash <(fill_in "$spec/post" "$spec" "$id" "$scratch/tmp") &> /dev/null
+        echo -n "$id "
+    done < "$specdir/name_to_number.txt"
+    echo
+}
+
+# Prints the median of its arguments
+function median(){
+    printf "%s\n" "$@" | sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+# Prints how long one run of `script` takes, in ns, under each of two shells,
+# as the median of 7 rounds of `runs` runs. The shells take turns going first
+# so that neither gets the quieter half of every round.
+function time_pair(){
+    local a="$1" b="$2" script="$3" runs="$4"
+    local times_a=() times_b=() round
+    for round in 1 2 3 4 5 6 7; do
+        if ((round % 2)); then
+            times_a+=($(time_runs "$a" "$script" "$runs"))
+            times_b+=($(time_runs "$b" "$script" "$runs"))
+        else
+            times_b+=($(time_runs "$b" "$script" "$runs"))
+            times_a+=($(time_runs "$a" "$script" "$runs"))
+        fi
+    done
+    echo "$(median "${times_a[@]}") $(median "${times_b[@]}")"
+}
+
+function time_runs(){
+    local shell="$1" script="$2" runs="$3" i start
+    start=$(date +%s%N)
+    for ((i = 0; i < runs; i++)); do
+        "$shell" "$script" > /dev/null
+    done
+    echo $(( ($(date +%s%N) - start) / runs ))
+}
+
+function report(){
+    # $1: label, $2: ns for the plain shell, $3: for the other one, $4: divisor
+    awk -v label="$1" -v a="$2" -v b="$3" -v n="$4" 'BEGIN {
+        printf "%-22s %10.2fus %10.2fus %+8.1f%%\n", label, a / n / 1000, b / n / 1000, (b / a - 1) * 100
+    }'
+}
+
+function compare(){
+    local plain="$1" other="$2"
+    local scratch
+    scratch="$(mktemp -d)"
+    trap 'rm -rf "$scratch"' EXIT
+
+    echo "exit" > "$scratch/startup"
+
+    local i
+    for ((i = 0; i < 20000; i++)); do
+        echo "cd . && path /bin /usr/bin"
+    done > "$scratch/builtins"
+
+    for ((i = 0; i < 500; i++)); do
+        echo "/bin/true"
+    done > "$scratch/externals"
+
+    # Startup is subtracted out of the per-command numbers
+    local start_a start_b builtin_a builtin_b ext_a ext_b
+    read -r start_a start_b < <(time_pair "$plain" "$other" "$scratch/startup" 200)
+    read -r builtin_a builtin_b < <(time_pair "$plain" "$other" "$scratch/builtins" 1)
+    read -r ext_a ext_b < <(time_pair "$plain" "$other" "$scratch/externals" 1)
+
+    printf "%-22s %12s %12s %9s\n" "" "$(basename "$plain")" "$(basename "$other")" "change"
+    report "startup" "$start_a" "$start_b" 1
+    report "builtin line (x2)" "$((builtin_a - start_a))" "$((builtin_b - start_b))" 20000
+    report "external command" "$((ext_a - start_a))" "$((ext_b - start_b))" 500
+}
+
+case "$1" in
+    train)
+        train
+        ;;
+    compare)
+        if [ $# -ne 3 ]; then
+            echo "usage: $0 compare SHELL_A SHELL_B" >&2
+            exit 1
+        fi
+        compare "$2" "$3"
+        ;;
+    *)
+        echo "usage: $0 train | compare SHELL_A SHELL_B" >&2
+        exit 1
+        ;;
+esac
@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+
+## Replays a trace written by `utcsh --record FILE` against a utcsh, with
+# every command swapped for a stand-in so that the replay exercises the shell
+# rather than whatever tools the trace happened to run:
+#
+#   sleep       /bin/sleep for the line's recorded duration, split evenly
+#               between its commands (and scaled down with --speed)
+#   argprinter  the argprinter utility (`make argprinter`), with the same args
+#
+# Commands that only change shell state (cd, path, exit, ...) are dropped,
+# as are redirects. By default lines are issued at their recorded times, one
+# shell, waiting for each to finish; --speed N compresses the schedule N
+# times (0 issues them back to back). --rate R instead issues R lines a
+# second no matter how far behind the shells are, spread across --shells
+# shells, and measures latency from when each line was due, so that a slow
+# shell can't hide its backlog.
+#
+# See src/trace.h for the trace format.
+
+import argparse
+import os
+import queue
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+TRACE_MAGIC = b"UTCSHTR\0"
+TRACE_VERSION = 1
+HEADER = struct.Struct("=8sIIQ")
+RECORD = struct.Struct("=QQIIII")
+
+PROMPT = b"utcsh> "
+
+# Builtins that only change the shell itself, which a replay has no use for
+STATE_BUILTINS = {
+    "cd", "path", "exit", "remote", "toggledebug", "togglebatch",
+    "togglekeeporder", "togglespread", "toggleperf", "stats",
+}
+
+CONNECTORS = {"&&": "&&", "||": "||", "&": "&", ";": ";"}
+
+
+def read_trace(path):
+    """Yields (start_ns, duration_ns, lineno, cwd, path, text) for every line,
+    with cwd and path carried forward from earlier records"""
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if len(data) < HEADER.size:
+        sys.exit(f"{path}: not a utcsh trace")
+
+    magic, version, _, _ = HEADER.unpack_from(data)
+    if magic != TRACE_MAGIC or version != TRACE_VERSION:
+        sys.exit(f"{path}: not a utcsh trace (or from another version)")
+
+    cwd, shell_path = "", ""
+    off = HEADER.size
+    while off + RECORD.size <= len(data):
+        start, duration, lineno, text_len, cwd_len, path_len = RECORD.unpack_from(data, off)
+        off += RECORD.size
+        if cwd_len:
+            cwd = data[off:off + cwd_len].decode(errors="replace")
+        off += cwd_len
+        if path_len:
+            shell_path = data[off:off + path_len].decode(errors="replace")
+        off += path_len
+        text = data[off:off + text_len].decode(errors="replace")
+        off += text_len
+        yield start, duration, lineno, cwd, shell_path, text
+
+
+def split_line(text):
+    """Splits a line into (words, connector) pairs the way utcsh does, where
+    connector is what joins it to the next command ("" for the last)"""
+    commands = []
+    segment = ""
+    i = 0
+    while i <= len(text):
+        op = text[i:i + 2] if text[i:i + 2] in ("&&", "||") else text[i:i + 1]
+        if i == len(text) or op in CONNECTORS:
+            words = segment.split()
+            if words:
+                commands.append([words, CONNECTORS.get(op, "")])
+            elif commands and op in (";", "&"):
+                commands[-1][1] = op
+            segment = ""
+            i += max(len(op), 1)
+        else:
+            segment += text[i]
+            i += 1
+    if commands:
+        commands[-1][1] = ""
+    return commands
+
+
+def stand_in(text, duration_s, args):
+    """The line to replay in place of `text`, or None if nothing in it is
+    worth replaying"""
+    commands = []
+    for words, connector in split_line(text):
+        if ">" in words:
+            words = words[:words.index(">")]
+        if not words or words[0] in STATE_BUILTINS:
+            continue
+        commands.append((words, connector))
+
+    if not commands:
+        return None
+
+    parts = []
+    for i, (words, connector) in enumerate(commands):
+        if args.standin == "argprinter":
+            parts.append(" ".join([args.argprinter] + words[1:]))
+        else:
+            parts.append(f"/bin/sleep {duration_s / len(commands):.6f}")
+        if i < len(commands) - 1:
+            parts.append(connector or ";")
+    return " ".join(parts)
+
+
+class Shell:
+    """An interactive utcsh, which prints its prompt once it is ready for the
+    next line: that is how we know a line has finished"""
+
+    def __init__(self, utcsh):
+        self.proc = subprocess.Popen([utcsh], stdin=subprocess.PIPE,
+                                     stdout=subprocess.PIPE,
+                                     stderr=subprocess.DEVNULL)
+        self.pending = b""
+        self.wait_prompt()
+
+    def wait_prompt(self):
+        while PROMPT not in self.pending:
+            chunk = os.read(self.proc.stdout.fileno(), 65536)
+            if not chunk:
+                sys.exit("replay: utcsh exited mid-replay")
+            self.pending += chunk
+        self.pending = self.pending[self.pending.index(PROMPT) + len(PROMPT):]
+
+    def run(self, line):
+        self.proc.stdin.write(line.encode() + b"\n")
+        self.proc.stdin.flush()
+        self.wait_prompt()
+
+    def close(self):
+        self.proc.stdin.close()
+        self.proc.wait()
+
+
+def percentile(values, pct):
+    ordered = sorted(values)
+    rank = max(0, -(-len(ordered) * pct // 100) - 1)
+    return ordered[rank]
+
+
+def replay_closed(lines, args):
+    """One shell, each line issued at its (scaled) recorded time or as soon as
+    the one before it finishes, whichever is later"""
+    shell = Shell(args.utcsh)
+    latencies = []
+    began = time.monotonic()
+
+    for start_ns, _, line in lines:
+        if args.speed > 0:
+            due = began + start_ns / 1e9 / args.speed
+            delay = due - time.monotonic()
+            if delay > 0:
+                time.sleep(delay)
+        issued = time.monotonic()
+        shell.run(line)
+        latencies.append(time.monotonic() - issued)
+
+    shell.close()
+    return latencies, time.monotonic() - began
+
+
+def replay_open(lines, args):
+    """Lines issued at a fixed rate across a pool of shells, with latency
+    counted from when each was due"""
+    work = queue.Queue()
+    latencies = []
+    lock = threading.Lock()
+
+    def worker():
+        shell = Shell(args.utcsh)
+        while True:
+            item = work.get()
+            if item is None:
+                break
+            due, line = item
+            shell.run(line)
+            with lock:
+                latencies.append(time.monotonic() - due)
+        shell.close()
+
+    threads = [threading.Thread(target=worker) for _ in range(args.shells)]
+    for t in threads:
+        t.start()
+
+    began = time.monotonic()
+    for i, (_, _, line) in enumerate(lines):
+        due = began + i / args.rate
+        delay = due - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+        work.put((due, line))
+
+    for _ in threads:
+        work.put(None)
+    for t in threads:
+        t.join()
+
+    return latencies, time.monotonic() - began
+
+
+def dump(path):
+    for start, duration, lineno, cwd, shell_path, text in read_trace(path):
+        print(f"{start / 1e6:.3f}ms +{duration / 1e6:.3f}ms line {lineno} "
+              f"[{cwd}] [{shell_path}] {text}")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a utcsh --record trace")
+    parser.add_argument("trace")
+    parser.add_argument("--utcsh", default="./utcsh", help="shell to replay against")
+    parser.add_argument("--standin", choices=["sleep", "argprinter"], default="sleep")
+    parser.add_argument("--argprinter", default=os.path.abspath("argprinter"),
+                        help="argprinter binary for --standin argprinter")
+    mode = parser.add_mutually_exclusive_group()
+    mode.add_argument("--speed", type=float, default=1.0,
+                      help="compress the recorded schedule this many times (0: no waiting)")
+    mode.add_argument("--rate", type=float, help="open loop: issue this many lines a second")
+    parser.add_argument("--shells", type=int, default=8, help="shells to spread --rate across")
+    parser.add_argument("--dump", action="store_true", help="print the trace instead")
+    args = parser.parse_args()
+
+    if args.dump:
+        return dump(args.trace)
+
+    speed = args.speed if args.speed > 0 else 1.0
+    lines = []
+    for start, duration, _, _, _, text in read_trace(args.trace):
+        line = stand_in(text, duration / 1e9 / speed, args)
+        if line is not None:
+            lines.append((start, duration, line))
+
+    if not lines:
+        sys.exit("replay: nothing in the trace to replay")
+
+    if args.rate:
+        latencies, wall = replay_open(lines, args)
+    else:
+        latencies, wall = replay_closed(lines, args)
+
+    print(f"lines       {len(latencies)}")
+    print(f"wall        {wall:.3f}s")
+    print(f"throughput  {len(latencies) / wall:.1f} lines/s")
+    print(f"recorded    {sum(d for _, d, _ in lines) / 1e9:.3f}s of line time")
+    print("latency     p50 {:.3f}ms  p90 {:.3f}ms  p99 {:.3f}ms  max {:.3f}ms".format(
+        *(percentile(latencies, p) * 1e3 for p in (50, 90, 99)), max(latencies) * 1e3))
+
+
+if __name__ == "__main__":
+    main()
@@ -14,8 +14,12 @@ import sys, os
 import subprocess
 import argparse
 import json
+import math
 import re
+import resource
+import statistics
 import textwrap
+import time
 from enum import Enum
 from subprocess import PIPE
 
@@ -36,6 +40,7 @@ class TestAction(Enum):
     RUN_SINGLE = 2
     DESCRIBE = 3
     GRADE = 4
+    BENCH = 5
 
 
 # Used for color printing. These don't change over the lifetime of the program
@@ -145,6 +150,14 @@ class TestInfo:
         self.rc = TestRc(json_obj["rc"])
         self.pointval = int(json_obj["pointval"])
         self.srcdir = pdir
+        self.dirname = os.path.basename(pdir)
+
+        # Optional: the most wall time (in seconds) the test may take
+        self.budget = json_obj.get("budget")
+
+        # Filled in by run_test: wall and child CPU time of the last run
+        self.wall = None
+        self.cpu = None
 
 
 class RuntimeTestParams:
@@ -159,7 +172,15 @@ class RuntimeTestParams:
         self.outpath = parsed_args.out
         self.inpath = "tests/test-specs"
         self.utildir = "tests/test-utils"
-        if parsed_args.compute_score:
+        self.tid = parsed_args.run_one
+        self.bench_runs = parsed_args.bench
+        self.warmup = parsed_args.warmup
+        self.baseline = parsed_args.baseline
+        self.save_baseline = parsed_args.save_baseline
+        self.threshold = parsed_args.threshold
+        if parsed_args.bench is not None:
+            self.action = TestAction.BENCH
+        elif parsed_args.compute_score:
             self.action = TestAction.GRADE
         elif parsed_args.describe is not None:
             self.action = TestAction.DESCRIBE
@@ -293,6 +314,11 @@ def check_abnormal_retcodes(code):
         return False
 
 
+def child_cpu():
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return usage.ru_utime + usage.ru_stime
+
+
 def run_test(testinfo, runparams):
     """Execute a test."""
     outdir = os.path.join(runparams.outpath, str(testinfo.idn))
@@ -317,6 +343,10 @@ def run_test(testinfo, runparams):
     if runparams.verbose:
         info("Running command: " + " ".join(cmd))
 
+    # Tests run one at a time, so the growth in RUSAGE_CHILDREN is all utcsh's
+    # (and that of whatever it ran)
+    cpu_before = child_cpu()
+    started = time.monotonic()
     try:
         cmd_res = subprocess.run(
             cmd, stdout=PIPE, stderr=PIPE, universal_newlines=True, timeout=30
@@ -324,6 +354,8 @@ def run_test(testinfo, runparams):
     except subprocess.TimeoutExpired as e:
         error(f"Test {testinfo.idn} timed out.")
         return False
+    testinfo.wall = time.monotonic() - started
+    testinfo.cpu = child_cpu() - cpu_before
 
     outfile = os.path.join(outdir, "out")
     errfile = os.path.join(outdir, "err")
@@ -335,6 +367,12 @@ def run_test(testinfo, runparams):
 
     success = True
 
+    if testinfo.budget is not None and testinfo.wall > testinfo.budget:
+        error(
+            f"Test {testinfo.idn} took {testinfo.wall:.2f}s, over its budget of {testinfo.budget}s"
+        )
+        success = False
+
     # Compare results and notify the user if they differ
     if testinfo.rc.nocrash:
         if check_abnormal_retcodes(retcode):
@@ -375,6 +413,109 @@ def run_test(testinfo, runparams):
     return success
 
 
+def percentile(values, pct):
+    """Nearest-rank percentile"""
+    ordered = sorted(values)
+    return ordered[max(0, math.ceil(len(ordered) * pct / 100) - 1)]
+
+
+def mann_whitney_p(base, cur):
+    """One-sided p-value that `cur` tends to be larger than `base`, from the
+    Mann-Whitney U test with the normal approximation (fine from about 5
+    samples each). Makes no assumptions about how the timings are distributed."""
+    n1, n2 = len(base), len(cur)
+    pooled = sorted([(v, 0) for v in base] + [(v, 1) for v in cur])
+
+    # Average ranks across ties, and collect the tie correction as we go
+    ranks = [0.0] * len(pooled)
+    ties = 0
+    i = 0
+    while i < len(pooled):
+        j = i
+        while j + 1 < len(pooled) and pooled[j + 1][0] == pooled[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2 + 1
+        ties += (j - i + 1) ** 3 - (j - i + 1)
+        i = j + 1
+
+    u = sum(r for r, (_, group) in zip(ranks, pooled) if group == 1) - n2 * (n2 + 1) / 2
+    n = n1 + n2
+    var = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)))
+    if var <= 0:
+        return 1.0
+    z = (u - n1 * n2 / 2 - 0.5) / math.sqrt(var)
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+
+def compare_timing(kind, base, cur, runparams):
+    """Describes how `cur` compares to `base`, and whether it's a regression:
+    significantly slower (p < 0.01) by more than the threshold"""
+    if not base:
+        return "no baseline", False
+    change = (statistics.median(cur) / max(statistics.median(base), 1e-9) - 1) * 100
+    p = mann_whitney_p(base, cur)
+    regressed = p < 0.01 and change > runparams.threshold
+    return f"{kind} {change:+.1f}% (p={p:.3f})", regressed
+
+
+def bench_test(testinfo, runparams):
+    """Runs a test --warmup times and then --bench times, returning its wall
+    and child CPU samples, or None if any run failed"""
+    walls, cpus = [], []
+    for i in range(runparams.warmup + runparams.bench_runs):
+        if not run_test(testinfo, runparams):
+            return None
+        if i >= runparams.warmup:
+            walls.append(testinfo.wall)
+            cpus.append(testinfo.cpu)
+    return walls, cpus
+
+
+def run_benchmarks(testspecs, runparams):
+    """Benchmarks the tests and compares them to the baseline file, returning
+    True if none of them failed or regressed"""
+    baseline = {}
+    if os.path.exists(runparams.baseline):
+        with open(runparams.baseline) as inf:
+            baseline = json.load(inf)
+
+    ok = True
+    for testspec in testspecs:
+        samples = bench_test(testspec, runparams)
+        if samples is None:
+            print_color(f"[FAIL]: Test {testspec.idn}", "red")
+            ok = False
+            continue
+
+        walls, cpus = samples
+        base = baseline.get(testspec.dirname, {})
+        wall_note, wall_regressed = compare_timing("wall", base.get("wall"), walls, runparams)
+        cpu_note, cpu_regressed = compare_timing("cpu", base.get("cpu"), cpus, runparams)
+
+        line = (
+            f"Test {testspec.idn:2} {testspec.dirname:24} "
+            f"wall p50 {statistics.median(walls):.3f}s p95 {percentile(walls, 95):.3f}s  "
+            f"cpu p50 {statistics.median(cpus):.3f}s p95 {percentile(cpus, 95):.3f}s  "
+            f"{wall_note}, {cpu_note}"
+        )
+        if wall_regressed or cpu_regressed:
+            print_color(f"[SLOW]: {line}", "red")
+            ok = False
+        else:
+            okay(f"[OK]: {line}")
+
+        if runparams.save_baseline:
+            baseline[testspec.dirname] = {"wall": walls, "cpu": cpus}
+
+    if runparams.save_baseline:
+        with open(runparams.baseline, "w") as outf:
+            json.dump(baseline, outf, indent=1)
+        info(f"Saved the timings as the new baseline in {runparams.baseline}")
+
+    return ok
+
+
 def replace_whitespace(string):
     output = ""
     for i in range(len(string)):
@@ -477,8 +618,36 @@ def main():
         metavar="path",
         default="./tests-out/",
     )
+    bench = parser.add_argument_group(
+        "benchmarking",
+        "Time the tests that have a budget (or just test n, with -t) and compare "
+        "them against a baseline. Exits 1 if any are significantly slower.",
+    )
+    bench.add_argument(
+        "--bench", type=int, metavar="n", help="Time n runs of each test"
+    )
+    bench.add_argument(
+        "--warmup", type=int, metavar="n", default=1,
+        help="Untimed runs before those (default 1)",
+    )
+    bench.add_argument(
+        "--baseline", metavar="path", default=".utcsh.bench.json",
+        help="Timings to compare against (default .utcsh.bench.json)",
+    )
+    bench.add_argument(
+        "--save-baseline", action="store_true",
+        help="Store this run's timings in the baseline file",
+    )
+    bench.add_argument(
+        "--threshold", type=float, metavar="pct", default=10,
+        help="Slowdown in the median that counts as a regression (default 10%%)",
+    )
 
     args = parser.parse_args()
+    if args.bench is not None and (args.compute_score or args.describe is not None):
+        parser.error("--bench can only be combined with -t")
+    if args.bench is not None and args.bench < 1:
+        parser.error("--bench needs at least one run")
     rtparams = RuntimeTestParams(args)
 
     if not try_make_path(args.out):
@@ -526,6 +695,13 @@ def main():
     elif rtparams.action == TestAction.DESCRIBE:
         testspec = get_test_spec(rtparams, rtparams.tid)
         describe_test(testspec, rtparams)
+    elif rtparams.action == TestAction.BENCH:
+        if rtparams.tid is not None:
+            testspecs = [get_test_spec(rtparams, rtparams.tid)]
+        else:
+            testspecs = [t for t in get_test_specs(rtparams) if t.budget is not None]
+        if not run_benchmarks(testspecs, rtparams):
+            sys.exit(1)
     elif rtparams.action == TestAction.GRADE:
         testspecs = get_test_specs(rtparams)
         successes = set()
@@ -1,14 +1,19 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdatomic.h> // Seriously?
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <dlfcn.h>
+#include <execinfo.h>
+#include <malloc.h>
+#include <sys/mman.h>
 
 #include "debug.h"
 
@@ -17,6 +22,7 @@
 // allocation tracker, which is much easier to work with.
 #define ALLOC_COUNTDOWN_TIMER_NAME "EBB_ALLOC_CTR"
 #define ALLOC_TRIGGERED_FILENAME ".ebb_alloc_fired"
+#define ALLOC_PROFILE_NAME "EBB_ALLOC_PROFILE"
 
 
 // Defined in other.c
@@ -39,9 +45,11 @@ in an infinite recursion of malloc() -> dlsym() -> malloc() (where malloc is our
 injected version) which blows the stack.
 
 To solve this, we borrow an idea from https://stackoverflow.com/a/10008252.
-We make a primitive bump-allocator using the space in mybuf, and use that
-space while initializing our system function pointers with dlsym. If we run
-out of space in that arena, then library initialization has failed.
+We make a primitive bump-allocator out of chunks we mmap() ourselves, and use
+that space while initializing our system function pointers with dlsym. The
+arena only maps what initialization actually asks for (usually nothing, or a
+single chunk), so it costs nothing in the common case. If we run out of
+chunks or mmap() fails, then library initialization has failed.
 
 Once the appropriate dlsym() calls have been made, we no longer need to worry
 about infinite recursion on malloc(). From that point on, all memory allocation
@@ -51,8 +59,16 @@ free() to check if they came from our bump arena.
 */
 
 // Variables used to track the bump allocator during the initialization phase.
-#define ARENA_SIZE 1000000000
-static char mybuf[ARENA_SIZE];
+// Every arena allocation is preceded by an ARENA_HEADER_SIZE header holding its
+// size, so that realloc() knows how much to copy out of it.
+#define ARENA_CHUNK_SIZE (64 << 10)
+#define ARENA_MAX_CHUNKS 16
+#define ARENA_HEADER_SIZE 16
+static struct {
+  char *start;
+  size_t size;
+} arenaChunks[ARENA_MAX_CHUNKS];
+static _Atomic int arenaNumChunks;
 static _Atomic bool sysfuncsReady;
 static _Atomic bool sysfuncsInitInProgress;
 
@@ -65,6 +81,10 @@ static _Atomic int allocCtr; // Number of allocation calls before failure.
 // so, we need to make sure that malloc works normally.
 _Atomic bool withinEBB;
 
+// Set while the allocation profiler is running, so that it neither profiles
+// nor fails its own allocations. See ebb_profile_init.
+static __thread bool inProfiler __attribute__((tls_model("initial-exec")));
+
 // Used to store pointers to system allocation functions so that we only
 // ever have to call dlsym() once (in a giant block on first allocation)
 typedef void *malloc_ty(size_t);
@@ -138,8 +158,9 @@ static void ebb_alloc_check_try_init() {
 // call should return NULL and false otherwise. Must have already initialized
 // timers before calling this--easiest way is to call ebb_alloc_check_try_init
 static bool check_and_dec_ctr() {
-  // Within EBB function calls, we do not decrement or explode at all.
-  if (withinEBB) {
+  // Within EBB function calls (the profiler included), we do not decrement or
+  // explode at all.
+  if (withinEBB || inProfiler) {
     return false;
   }
 
@@ -155,7 +176,10 @@ static bool check_and_dec_ctr() {
       exploded = true;
       DEBUG_PRINT("BOOM. alloc has failed.\n");
 
-      creat(gen_ebb_filepath(ALLOC_TRIGGERED_FILENAME), S_IRWXU);
+      // Use the real creat: ours might initialize the syscall countdown, which
+      // reuses the buffer gen_ebb_filepath returned for the pid file's name
+      int (*creatFunc)(const char *, mode_t) = dlsym(RTLD_NEXT, "creat");
+      creatFunc(gen_ebb_filepath(ALLOC_TRIGGERED_FILENAME), S_IRWXU);
       return true;
     } else {
       --allocCtr;
@@ -168,30 +192,282 @@ static bool check_and_dec_ctr() {
 // on a flat address space for this to work. See link for how this can fail
 // on x86: https://devblogs.microsoft.com/oldnewthing/20170927-00/?p=97095
 static bool ptr_from_internal_arena(void *ptr) {
-  uintptr_t arena_start = (uintptr_t)mybuf;
-  uintptr_t arena_end = (uintptr_t)(mybuf + ARENA_SIZE);
   uintptr_t test = (uintptr_t)ptr;
-  return arena_start <= test && test < arena_end;
+  int numChunks = arenaNumChunks;
+  for (int i = 0; i < numChunks; i++) {
+    uintptr_t arena_start = (uintptr_t)arenaChunks[i].start;
+    uintptr_t arena_end = arena_start + arenaChunks[i].size;
+    if (arena_start <= test && test < arena_end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t arena_alloc_size(void *ptr) {
+  return *(size_t *)((char *)ptr - ARENA_HEADER_SIZE);
 }
 
 // A toy bump-allocator that is only used during the initialization phase.
-// Bumps high-to-low because of **tradition**, dammit.
+// Bumps high-to-low because of **tradition**, dammit. Maps another chunk
+// whenever the current one runs out, or a chunk of its own for anything too
+// big to share one.
 void *init_malloc(size_t nbytes) {
-  static char *bump_ptr = mybuf + ARENA_SIZE;
+  static char *bump_ptr;
+  static char *bump_floor;
   static bool err_msg_written = false;
 
-  bump_ptr -= nbytes;
-  bool out_of_space = (uintptr_t)bump_ptr < (uintptr_t)mybuf;
-  if (out_of_space) {
-    if (!err_msg_written) {
-      char err_msg[48] = "EBB: Out of space during malloc initialization!";
-      int unused = write(STDERR_FILENO, err_msg, 48);
-      (void)unused; // Can't really do anything if it fails
-      err_msg_written = true;
+  size_t needed = ARENA_HEADER_SIZE +
+                  ((nbytes + ARENA_HEADER_SIZE - 1) & ~(size_t)(ARENA_HEADER_SIZE - 1));
+
+  if (!bump_ptr || (size_t)(bump_ptr - bump_floor) < needed) {
+    size_t chunk_size = needed > ARENA_CHUNK_SIZE ? needed : ARENA_CHUNK_SIZE;
+    char *chunk = MAP_FAILED;
+    if (arenaNumChunks < ARENA_MAX_CHUNKS) {
+      chunk = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if (chunk == MAP_FAILED) {
+      if (!err_msg_written) {
+        char err_msg[48] = "EBB: Out of space during malloc initialization!";
+        int unused = write(STDERR_FILENO, err_msg, 48);
+        (void)unused; // Can't really do anything if it fails
+        err_msg_written = true;
+      }
       return NULL;
     }
+
+    arenaChunks[arenaNumChunks].start = chunk;
+    arenaChunks[arenaNumChunks].size = chunk_size;
+    arenaNumChunks++;
+    bump_floor = chunk;
+    bump_ptr = chunk + chunk_size;
+  }
+
+  // Fresh mappings are zeroed and the arena never reuses space, so this
+  // doubles as calloc() too
+  bump_ptr -= needed;
+  *(size_t *)bump_ptr = nbytes;
+  return bump_ptr + ARENA_HEADER_SIZE;
+}
+
+/* Allocation profiling
+
+Setting EBB_ALLOC_PROFILE=<file> makes this library count every allocation
+utcsh makes instead of (or as well as) failing one of them. Each call is
+charged to its call site, which is the return addresses of the
+PROFILE_DEPTH frames above malloc() and friends, hashed into a fixed table of
+PROFILE_SITES sites. Live bytes are tracked with malloc_usable_size(), so
+peak live bytes include allocator rounding but not its bookkeeping.
+
+The report is written to <file> when utcsh exits normally (forked children
+count into their own copy of the table and never report, and exec'd ones
+don't load the library at all). It lists the totals, then every site busiest
+first, one frame per line as backtrace_symbols_fd() prints it. Frames inside
+utcsh show up as `./utcsh(+0x1234)`, which `addr2line -fe utcsh 0x1234` turns
+into a function and line. Note that the syscall hooks in other.c still create
+their .ebb_files directory in the current directory.
+
+Allocations made by the profiler itself (backtrace() loads libgcc_s the first
+time around, and qsort() may allocate while reporting) are not counted. */
+#define PROFILE_DEPTH 8
+#define PROFILE_SITES 4096 // Must be a power of two
+#define PROFILE_MAX_PROBES 64
+
+typedef struct AllocSite {
+  uint64_t hash; // 0 if the slot is empty
+  int depth;
+  void *frames[PROFILE_DEPTH];
+  uint64_t calls;
+  uint64_t bytes;
+} AllocSite;
+
+static bool profiling;
+static pid_t profileOwner;
+static char profilePath[2048];
+
+static AllocSite profileSites[PROFILE_SITES];
+static int profileOrder[PROFILE_SITES];
+static uint64_t numSites;
+static uint64_t droppedCalls; // from sites that didn't fit in the table
+static uint64_t mallocCalls, callocCalls, reallocCalls, freeCalls;
+static uint64_t requestedBytes, liveBytes, peakLiveBytes;
+
+// utcsh only ever allocates from a few threads at once (the PATH indexer), so
+// a spinlock is plenty
+static atomic_flag profileLock = ATOMIC_FLAG_INIT;
+
+static void profile_lock() {
+  while (atomic_flag_test_and_set_explicit(&profileLock, memory_order_acquire))
+    ;
+}
+
+static void profile_unlock() {
+  atomic_flag_clear_explicit(&profileLock, memory_order_release);
+}
+
+static bool profile_active() {
+  return profiling && !inProfiler;
+}
+
+static void add_live_bytes(size_t added, size_t removed) {
+  liveBytes += added;
+  liveBytes -= removed;
+  if (liveBytes > peakLiveBytes) {
+    peakLiveBytes = liveBytes;
+  }
+}
+
+static AllocSite *find_site(void **frames, int depth) {
+  uint64_t hash = 14695981039346656037ULL; // FNV-1a, a pointer at a time
+  for (int i = 0; i < depth; i++) {
+    hash = (hash ^ (uintptr_t)frames[i]) * 1099511628211ULL;
+  }
+  hash = hash ? hash : 1;
+
+  for (int probe = 0; probe < PROFILE_MAX_PROBES; probe++) {
+    AllocSite *site = &profileSites[(hash + probe) & (PROFILE_SITES - 1)];
+    if (site->hash == 0) {
+      site->hash = hash;
+      site->depth = depth;
+      memcpy(site->frames, frames, depth * sizeof *frames);
+      numSites++;
+      return site;
+    }
+    if (site->hash == hash && site->depth == depth &&
+        memcmp(site->frames, frames, depth * sizeof *frames) == 0) {
+      return site;
+    }
+  }
+  return NULL;
+}
+
+// Charges one call to whoever called our malloc/calloc/realloc. Must not be
+// inlined, so that the two frames it skips are always itself and the hook.
+__attribute__((noinline)) static void
+profile_alloc(uint64_t *kindCalls, size_t nbytes, size_t added, size_t removed) {
+  void *frames[PROFILE_DEPTH + 2];
+  inProfiler = true;
+  int depth = backtrace(frames, PROFILE_DEPTH + 2) - 2;
+  depth = depth < 0 ? 0 : depth;
+
+  profile_lock();
+  AllocSite *site = find_site(frames + 2, depth);
+  if (site) {
+    site->calls++;
+    site->bytes += nbytes;
+  } else {
+    droppedCalls++;
+  }
+  (*kindCalls)++;
+  requestedBytes += nbytes;
+  add_live_bytes(added, removed);
+  profile_unlock();
+  inProfiler = false;
+}
+
+static void profile_free(size_t removed) {
+  profile_lock();
+  freeCalls++;
+  add_live_bytes(0, removed);
+  profile_unlock();
+}
+
+static int busiest_first(const void *a, const void *b) {
+  const AllocSite *x = &profileSites[*(const int *)a];
+  const AllocSite *y = &profileSites[*(const int *)b];
+  if (x->calls != y->calls) {
+    return x->calls < y->calls ? 1 : -1;
+  }
+  return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+__attribute__((constructor)) static void ebb_profile_init() {
+  char *path = getenv(ALLOC_PROFILE_NAME);
+  if (!path || !*path) {
+    return;
+  }
+
+  // utcsh may cd before it exits, so pin relative paths down now. Use the
+  // real getcwd() so that this can't count against (or trip) the countdown.
+  profilePath[0] = '\0';
+  if (path[0] != '/') {
+    char *(*getcwdFunc)(char *, size_t) = dlsym(RTLD_NEXT, "getcwd");
+    if (!getcwdFunc(profilePath, sizeof profilePath - 1)) {
+      fprintf(stderr, "EBB: could not resolve profile path %s\n", path);
+      return;
+    }
+    strcat(profilePath, "/");
+  }
+  if (strlen(profilePath) + strlen(path) >= sizeof profilePath) {
+    fprintf(stderr, "EBB: profile path %s is too long\n", path);
+    return;
   }
-  return bump_ptr;
+  strcat(profilePath, path);
+
+  // The first backtrace() dlopen()s libgcc_s, which allocates. Get that out
+  // of the way before anything is counted.
+  void *frame;
+  inProfiler = true;
+  backtrace(&frame, 1);
+  inProfiler = false;
+
+  profileOwner = getpid();
+  profiling = true;
+}
+
+// Destructors run after utcsh's own atexit() handlers, so the report sees
+// everything they free too
+__attribute__((destructor)) static void ebb_profile_report() {
+  if (!profiling || getpid() != profileOwner) {
+    return;
+  }
+
+  // Our own open() and close() would count against EBB_SYSCALL_CTR
+  int (*openFunc)(const char *, int, ...) = dlsym(RTLD_NEXT, "open");
+  int (*closeFunc)(int) = dlsym(RTLD_NEXT, "close");
+  int fd = openFunc(profilePath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "EBB: could not write profile to %s\n", profilePath);
+    return;
+  }
+
+  inProfiler = true;
+  profile_lock();
+
+  int n = 0;
+  for (int i = 0; i < PROFILE_SITES; i++) {
+    if (profileSites[i].hash) {
+      profileOrder[n++] = i;
+    }
+  }
+  qsort(profileOrder, n, sizeof *profileOrder, busiest_first);
+
+  dprintf(fd, "EBB allocation profile for pid %d\n", (int)profileOwner);
+  dprintf(fd, "calls %lu (malloc %lu, calloc %lu, realloc %lu), frees %lu\n",
+          (unsigned long)(mallocCalls + callocCalls + reallocCalls),
+          (unsigned long)mallocCalls, (unsigned long)callocCalls,
+          (unsigned long)reallocCalls, (unsigned long)freeCalls);
+  dprintf(fd, "bytes requested %lu, peak live %lu, live at exit %lu\n",
+          (unsigned long)requestedBytes, (unsigned long)peakLiveBytes,
+          (unsigned long)liveBytes);
+  dprintf(fd, "sites %lu, calls from sites that didn't fit %lu\n",
+          (unsigned long)numSites, (unsigned long)droppedCalls);
+
+  for (int i = 0; i < n; i++) {
+    AllocSite *site = &profileSites[profileOrder[i]];
+    dprintf(fd, "\n#%d: %lu calls, %lu bytes\n", i + 1,
+            (unsigned long)site->calls, (unsigned long)site->bytes);
+    for (int f = 0; f < site->depth; f++) {
+      dprintf(fd, "    ");
+      backtrace_symbols_fd(&site->frames[f], 1, fd);
+    }
+  }
+
+  profile_unlock();
+  inProfiler = false;
+  closeFunc(fd);
 }
 
 void *malloc(size_t nbytes) {
@@ -203,35 +479,80 @@ void *malloc(size_t nbytes) {
 
   ebb_alloc_check_try_init();
   if (check_and_dec_ctr()) {
+    errno = ENOMEM;
     return NULL;
-  } else {
-    return sysMalloc(nbytes);
   }
+
+  void *ptr = sysMalloc(nbytes);
+  if (ptr && profile_active()) {
+    profile_alloc(&mallocCalls, nbytes, malloc_usable_size(ptr), 0);
+  }
+  return ptr;
 }
 
 void *calloc(size_t c, size_t n) {
+  // c * n is used unchecked below, for the init arena and the profile
+  if (n && c > SIZE_MAX / n) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  // dlsym() may calloc() too (for its error state)
+  if (sysfuncsInitInProgress) {
+    return init_malloc(c * n);
+  }
+
   ebb_alloc_check_try_init();
   if (check_and_dec_ctr()) {
+    errno = ENOMEM;
     return NULL;
-  } else {
-    return sysCalloc(c, n);
   }
+
+  void *ptr = sysCalloc(c, n);
+  if (ptr && profile_active()) {
+    profile_alloc(&callocCalls, c * n, malloc_usable_size(ptr), 0);
+  }
+  return ptr;
 }
 
 void *realloc(void *ptr, size_t size) {
+  if (sysfuncsInitInProgress && (!ptr || ptr_from_internal_arena(ptr))) {
+    void *moved = init_malloc(size);
+    if (moved && ptr) {
+      size_t old = arena_alloc_size(ptr);
+      memcpy(moved, ptr, old < size ? old : size);
+    }
+    return moved;
+  }
+
   ebb_alloc_check_try_init();
 
-  // Requesting realloc of an arena pointer. Satisfy the request by allocating
-  // the larger buffer in the arena to avoid UB with sys_realloc.
+  // Requesting realloc of an arena pointer. Satisfy the request by copying it
+  // out to a regular allocation, to avoid UB with sys_realloc.
   if (ptr_from_internal_arena(ptr)) {
-    return init_malloc(size);
+    void *moved = malloc(size);
+    if (moved) {
+      size_t old = arena_alloc_size(ptr);
+      memcpy(moved, ptr, old < size ? old : size);
+    }
+    return moved;
   }
 
   if (check_and_dec_ctr()) {
+    errno = ENOMEM;
     return NULL;
-  } else {
-    return sysRealloc(ptr, size);
   }
+
+  size_t old = ptr && profile_active() ? malloc_usable_size(ptr) : 0;
+  void *moved = sysRealloc(ptr, size);
+  if (profile_active()) {
+    if (moved) {
+      profile_alloc(&reallocCalls, size, malloc_usable_size(moved), old);
+    } else if (ptr && size == 0) {
+      profile_free(old); // realloc(ptr, 0) is free(ptr)
+    }
+  }
+  return moved;
 }
 
 void free(void *ptr) {
@@ -239,6 +560,9 @@ void free(void *ptr) {
     return;
   }
   if (!ptr_from_internal_arena(ptr)) {
+    if (profile_active()) {
+      profile_free(malloc_usable_size(ptr));
+    }
     sysFree(ptr);
   }
   // If pointer is from bump area, free() is a no-op
@@ -5,15 +5,19 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <signal.h>
 #include <dlfcn.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "debug.h"
 
@@ -50,6 +54,8 @@ typedef ssize_t (*getline_ty)(char **restrict lineptr, size_t *restrict n,
 typedef int (*execv_ty)(const char *pathname, char *const argv[]);
 typedef pid_t (*fork_ty)(void);
 typedef pid_t (*wait_ty)(int *wstatus);
+typedef pid_t (*waitpid_ty)(pid_t pid, int *wstatus, int options);
+typedef void (*exit_ty)(int status);
 
 /* How many ways can each function fail? This *must* be kept up-to-date with
 the FalliableFunc enum and the actual error list or issues will arise!! */
@@ -80,11 +86,19 @@ int *FailureModes[12] = {OpenFailures,   CloseFailures,  FopenFailures,
                          Dup2Failures,   GetcwdFailures, GetlineFailures,
                          ExecvFailures,  ForkFailures,   WaitFailures};
 
+/* The names that EBB_SYSCALL_FUNC and EBB_LATENCY know the functions by */
+const char *FuncNames[12] = {"open",   "close",  "fopen",   "fclose",
+                             "fseek",  "creat",  "dup2",    "getcwd",
+                             "getline", "execv", "fork",    "wait"};
+
+// Set by EBB_SYSCALL_MODE (see check_and_dec_ctr), or -1 to pick at random
+static int forcedFailIdx = -1;
+
 /* Returns an appropriate failure for the given function call */
 int randomize_failure_kind(enum FalliableFunc funcCalled) {
   int idx = (int)funcCalled;
   int *validFailureModes = FailureModes[idx];
-  int failIdx = rand() % NumFailureModes[idx];
+  int failIdx = forcedFailIdx >= 0 ? forcedFailIdx : rand() % NumFailureModes[idx];
   return validFailureModes[failIdx];
 }
 
@@ -216,11 +230,57 @@ static _Atomic int syscallCtr; // Number of calls before failure.
 #define SYSCALL_COUNTDOWN_TIMER_NAME "EBB_SYSCALL_CTR"
 #define SYSCALL_TRIGGERED_FILENAME ".ebb_syscall_fired"
 
-static bool check_and_dec_ctr() {
+/* By default every hooked call counts towards EBB_SYSCALL_CTR, and the one
+   that fails picks its errno at random. EBB_SYSCALL_FUNC=<name> only counts
+   (and fails) calls to that function, and EBB_SYSCALL_MODE=<errno name>
+   additionally picks which of its failure modes to use, so that a sweep can
+   try every (function, errno, countdown) point on its own. */
+#define SYSCALL_FUNC_NAME "EBB_SYSCALL_FUNC"
+#define SYSCALL_MODE_NAME "EBB_SYSCALL_MODE"
+
+static int targetFunc = -1; // Only count calls to this function, if set
+
+static void init_target() {
+  char *func_s = getenv(SYSCALL_FUNC_NAME);
+  char *mode_s = getenv(SYSCALL_MODE_NAME);
+  if (!func_s) {
+    if (mode_s) {
+      fprintf(stderr, "EBB: %s needs %s\n", SYSCALL_MODE_NAME, SYSCALL_FUNC_NAME);
+      abort();
+    }
+    return;
+  }
+
+  for (int i = 0; i < 12; i++) {
+    if (strcmp(func_s, FuncNames[i]) == 0) {
+      targetFunc = i;
+    }
+  }
+  if (targetFunc == -1) {
+    fprintf(stderr, "EBB: unknown %s '%s'\n", SYSCALL_FUNC_NAME, func_s);
+    abort();
+  }
+
+  if (!mode_s) {
+    return;
+  }
+  for (int i = 0; i < NumFailureModes[targetFunc]; i++) {
+    if (strcmp(mode_s, strerrorname_np(FailureModes[targetFunc][i])) == 0) {
+      forcedFailIdx = i;
+    }
+  }
+  if (forcedFailIdx == -1) {
+    fprintf(stderr, "EBB: %s can't fail with %s\n", func_s, mode_s);
+    abort();
+  }
+}
+
+static bool check_and_dec_ctr(enum FalliableFunc funcCalled) {
   // If it has not been done yet, initialize our countdown from the environ
   if (!countdownIsInit) {
     countdownIsInit = true;
     create_ebb_pid_file();
+    init_target();
 
     char *ctdown_s = getenv(SYSCALL_COUNTDOWN_TIMER_NAME);
     int ctdown;
@@ -242,6 +302,10 @@ static bool check_and_dec_ctr() {
     }
   }
 
+  if (targetFunc != -1 && (int)funcCalled != targetFunc) {
+    return false;
+  }
+
   /* See if we should asplode the function on this call. If not, move us closer
      to the countdown. */
   if (!exploded) {
@@ -260,10 +324,214 @@ static bool check_and_dec_ctr() {
   return false;
 }
 
+/** Latency injection
+
+EBB_LATENCY makes the hooked functions slow instead of (or as well as) making
+them fail. It is a comma-separated list of FUNC=DELAY, where FUNC is one of the
+names in FuncNames above or `all`, and DELAY is one of
+
+    TIME                  always TIME
+    uniform:LO:HI         uniformly distributed between LO and HI
+    exp:MEAN              exponentially distributed with mean MEAN
+    normal:MEAN:STDDEV    normally distributed (negative draws become 0)
+
+optionally followed by @P to only delay a fraction P of the calls, e.g.
+`EBB_LATENCY=fork=uniform:5ms:20ms,open=50ms@0.1`. TIMEs are a number with a
+unit of ns, us, ms or s (us if there is none). Later entries override earlier
+ones, so `all=1ms,fork=10ms` works as expected.
+
+The delay is taken before the real call is made. Draws come from a generator
+seeded with EBB_LATENCY_SEED (or the time, if that isn't set), which each
+forked child reseeds with its pid so that siblings don't get the same delays.
+utcsh reaps with waitpid() rather than wait(), so waitpid() is hooked too and
+gets wait's delay, though it never fails. */
+#define LATENCY_SPEC_NAME "EBB_LATENCY"
+#define LATENCY_SEED_NAME "EBB_LATENCY_SEED"
+
+enum DelayKind { NoDelay, Fixed, Uniform, Exponential, Normal };
+
+typedef struct Delay {
+  enum DelayKind kind;
+  double a, b; // In ns. The only value, LO and HI, or MEAN (and STDDEV)
+  double probability;
+} Delay;
+
+static Delay Delays[12];
+static bool latencyIsInit;
+static uint64_t latencyRng;
+
+static void bad_latency_spec(const char *entry) {
+  fprintf(stderr, "EBB: bad %s entry '%s'\n", LATENCY_SPEC_NAME, entry);
+  abort();
+}
+
+// Parses a TIME at *s into ns and moves *s past it
+static double parse_time(char **s, const char *entry) {
+  char *end;
+  double t = strtod(*s, &end);
+  if (end == *s || t < 0) {
+    bad_latency_spec(entry);
+  }
+
+  double scale = 1e3;
+  if (strncmp(end, "ns", 2) == 0) {
+    scale = 1, end += 2;
+  } else if (strncmp(end, "us", 2) == 0) {
+    scale = 1e3, end += 2;
+  } else if (strncmp(end, "ms", 2) == 0) {
+    scale = 1e6, end += 2;
+  } else if (*end == 's') {
+    scale = 1e9, end += 1;
+  }
+
+  *s = end;
+  return t * scale;
+}
+
+static Delay parse_delay(char *s, const char *entry) {
+  Delay d = {.kind = Fixed, .probability = 1};
+
+  if (strncmp(s, "uniform:", 8) == 0) {
+    s += 8;
+    d.kind = Uniform;
+    d.a = parse_time(&s, entry);
+    if (*s++ != ':') {
+      bad_latency_spec(entry);
+    }
+    d.b = parse_time(&s, entry);
+    if (d.b < d.a) {
+      bad_latency_spec(entry);
+    }
+  } else if (strncmp(s, "exp:", 4) == 0) {
+    s += 4;
+    d.kind = Exponential;
+    d.a = parse_time(&s, entry);
+  } else if (strncmp(s, "normal:", 7) == 0) {
+    s += 7;
+    d.kind = Normal;
+    d.a = parse_time(&s, entry);
+    if (*s++ != ':') {
+      bad_latency_spec(entry);
+    }
+    d.b = parse_time(&s, entry);
+  } else {
+    d.a = parse_time(&s, entry);
+  }
+
+  if (*s == '@') {
+    char *end;
+    d.probability = strtod(s + 1, &end);
+    if (end == s + 1 || d.probability < 0 || d.probability > 1) {
+      bad_latency_spec(entry);
+    }
+    s = end;
+  }
+
+  if (*s != '\0') {
+    bad_latency_spec(entry);
+  }
+  return d;
+}
+
+static void latency_init() {
+  latencyIsInit = true;
+
+  char *seed_s = getenv(LATENCY_SEED_NAME);
+  latencyRng = seed_s ? strtoull(seed_s, NULL, 0) : (uint64_t)time(NULL);
+  latencyRng = latencyRng * 2654435761u + 1; // xorshift can't start at 0
+
+  // Copied so that strtok doesn't scribble on the environment
+  static char spec[1024];
+  char *spec_s = getenv(LATENCY_SPEC_NAME);
+  if (!spec_s) {
+    return;
+  }
+  if (strlen(spec_s) >= sizeof spec) {
+    bad_latency_spec(spec_s);
+  }
+  strcpy(spec, spec_s);
+
+  char *saveptr;
+  for (char *entry = strtok_r(spec, ",", &saveptr); entry;
+       entry = strtok_r(NULL, ",", &saveptr)) {
+    static char whole[sizeof spec]; // For error messages
+    strcpy(whole, entry);
+
+    char *eq = strchr(entry, '=');
+    if (!eq) {
+      bad_latency_spec(whole);
+    }
+    *eq = '\0';
+    Delay d = parse_delay(eq + 1, whole);
+
+    bool known = false;
+    for (int i = 0; i < 12; i++) {
+      if (strcmp(entry, "all") == 0 || strcmp(entry, FuncNames[i]) == 0) {
+        Delays[i] = d;
+        known = true;
+      }
+    }
+    if (!known) {
+      bad_latency_spec(whole);
+    }
+  }
+}
+
+// Uniform on [0, 1), from xorshift64*
+static double latency_rand() {
+  latencyRng ^= latencyRng >> 12;
+  latencyRng ^= latencyRng << 25;
+  latencyRng ^= latencyRng >> 27;
+  return ((latencyRng * 2685821657736338717ULL) >> 11) * 0x1.0p-53;
+}
+
+static double draw_delay(Delay *d) {
+  switch (d->kind) {
+  case Fixed:
+    return d->a;
+  case Uniform:
+    return d->a + (d->b - d->a) * latency_rand();
+  case Exponential:
+    return -d->a * log1p(-latency_rand());
+  case Normal: {
+    // Box-Muller; 1 - rand() keeps log() away from 0
+    double u1 = 1 - latency_rand();
+    double u2 = latency_rand();
+    double x = d->a + d->b * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+    return x > 0 ? x : 0;
+  }
+  default:
+    return 0;
+  }
+}
+
+/* Sleeps for however long funcCalled is meant to take. Signals (e.g. utcsh's
+   SIGCHLD handler) don't cut the delay short. */
+static void inject_latency(enum FalliableFunc funcCalled) {
+  if (!latencyIsInit) {
+    latency_init();
+  }
+
+  Delay *d = &Delays[funcCalled];
+  if (d->kind == NoDelay) {
+    return;
+  }
+  if (d->probability < 1 && latency_rand() >= d->probability) {
+    return;
+  }
+
+  double ns = draw_delay(d);
+  struct timespec left = {.tv_sec = (time_t)(ns / 1e9),
+                          .tv_nsec = (long)fmod(ns, 1e9)};
+  while (nanosleep(&left, &left) == -1 && errno == EINTR)
+    ;
+}
+
 int open(const char *pathname, int flags, ...) {
   withinEBB = true;
   int rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Open);
+  if (check_and_dec_ctr(Open)) {
     rv = syscall_fail(Open);
   } else {
     open_ty openFunc = dlsym(RTLD_NEXT, "open");
@@ -276,7 +544,8 @@ int open(const char *pathname, int flags, ...) {
 int close(int fd) {
   withinEBB = true;
   int rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Close);
+  if (check_and_dec_ctr(Close)) {
     rv = syscall_fail(Close);
   } else {
     close_ty closeFunc = dlsym(RTLD_NEXT, "close");
@@ -288,7 +557,8 @@ int close(int fd) {
 FILE *fopen(const char *restrict pathname, const char *restrict mode) {
   withinEBB = true;
   FILE *rv = NULL;
-  if (check_and_dec_ctr()) {
+  inject_latency(Fopen);
+  if (check_and_dec_ctr(Fopen)) {
     syscall_fail(Fopen); // Just for setting errno
     rv = NULL;
   } else {
@@ -302,7 +572,8 @@ FILE *fopen(const char *restrict pathname, const char *restrict mode) {
 int fclose(FILE *stream) {
   withinEBB = true;
   int rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Fclose);
+  if (check_and_dec_ctr(Fclose)) {
     rv = syscall_fail(Fclose);
   } else {
     fclose_ty fcloseFunc = dlsym(RTLD_NEXT, "fclose");
@@ -315,7 +586,8 @@ int fclose(FILE *stream) {
 int fseek(FILE *stream, long offset, int whence) {
   withinEBB = true;
   int rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Fseek);
+  if (check_and_dec_ctr(Fseek)) {
     rv = syscall_fail(Fseek);
   } else {
     fseek_ty fseekFunc = dlsym(RTLD_NEXT, "fseek");
@@ -328,7 +600,8 @@ int fseek(FILE *stream, long offset, int whence) {
 int creat(const char *path, mode_t mode) {
   withinEBB = true;
   int rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Creat);
+  if (check_and_dec_ctr(Creat)) {
     rv = syscall_fail(Creat);
   } else {
     creat_ty creatFunc = dlsym(RTLD_NEXT, "creat");
@@ -340,7 +613,8 @@ int creat(const char *path, mode_t mode) {
 int dup2(int fd1, int fd2) {
   withinEBB = true;
   int rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Dup2);
+  if (check_and_dec_ctr(Dup2)) {
     rv = syscall_fail(Dup2);
   } else {
     dup2_ty dup2Func = dlsym(RTLD_NEXT, "dup2");
@@ -352,7 +626,8 @@ int dup2(int fd1, int fd2) {
 char *getcwd(char *buf, size_t size) {
   withinEBB = true;
   char *rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Getcwd);
+  if (check_and_dec_ctr(Getcwd)) {
     syscall_fail(Getcwd); // Just for setting ernno
     rv = NULL;
   } else {
@@ -373,7 +648,8 @@ ssize_t getline(char **restrict lineptr, size_t *restrict n,
                 FILE *restrict stream) {
   withinEBB = true;
   ssize_t rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Getline);
+  if (check_and_dec_ctr(Getline)) {
     rv = syscall_fail(Getline);
   } else {
     getline_ty getlineFunc = dlsym(RTLD_NEXT, "getline");
@@ -385,7 +661,8 @@ ssize_t getline(char **restrict lineptr, size_t *restrict n,
 int execv(const char *pathname, char *const argv[]) {
   withinEBB = true;
   int rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Execv);
+  if (check_and_dec_ctr(Execv)) {
     rv = syscall_fail(Execv);
   } else {
     // We need to unset the LD_PRELOAD flag, or evilboombox will also infect the
@@ -405,13 +682,15 @@ int execv(const char *pathname, char *const argv[]) {
 pid_t fork(void) {
   withinEBB = true;
   pid_t rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Fork);
+  if (check_and_dec_ctr(Fork)) {
     rv = syscall_fail(Fork);
   } else {
     fork_ty forkFunc = dlsym(RTLD_NEXT, "fork");
     rv = forkFunc();
     if (rv == 0){
       create_ebb_pid_file();
+      latencyRng ^= (uint64_t)getpid() * 0x9E3779B97F4A7C15ULL;
     }
   }
   withinEBB = false;
@@ -420,7 +699,8 @@ pid_t fork(void) {
 pid_t wait(int *wstatus) {
   withinEBB = true;
   pid_t rv;
-  if (check_and_dec_ctr()) {
+  inject_latency(Wait);
+  if (check_and_dec_ctr(Wait)) {
     rv = syscall_fail(Wait);
   } else {
     wait_ty waitFunc = dlsym(RTLD_NEXT, "wait");
@@ -429,3 +709,28 @@ pid_t wait(int *wstatus) {
   withinEBB = false;
   return rv;
 }
+pid_t waitpid(pid_t pid, int *wstatus, int options) {
+  withinEBB = true;
+  inject_latency(Wait);
+  waitpid_ty waitpidFunc = dlsym(RTLD_NEXT, "waitpid");
+  pid_t rv = waitpidFunc(pid, wstatus, options);
+  withinEBB = false;
+  return rv;
+}
+
+/* Processes that leave through _exit() skip the atexit() hook that deletes
+   their PID file, so by default they look like they crashed. utcsh's forked
+   children that never exec leave that way on purpose, so when
+   EBB_EXIT_IS_CLEAN is set, _exit() deletes the PID file as well. Only
+   tests/ebb-sweep.py sets it; other users keep flagging every _exit(). */
+#define EXIT_IS_CLEAN_NAME "EBB_EXIT_IS_CLEAN"
+
+void _exit(int status) {
+  withinEBB = true;
+  if (getenv(EXIT_IS_CLEAN_NAME)) {
+    delete_ebb_pid_file();
+  }
+  exit_ty exitFunc = dlsym(RTLD_NEXT, "_exit");
+  exitFunc(status);
+  __builtin_unreachable();
+}